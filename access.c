@@ -243,50 +243,400 @@ static int match_address(const char *addr, const char *tok)
 	return ret;
 }
 
-static int access_match(const char *list, const char *addr, const char **host_ptr)
+/* A "hosts allow" or "hosts deny" list is compiled before it is used:  the
+ * address entries go into a binary trie per address family, the names into
+ * a hash table, and only the wildcards, @netgroups, and unusual masks are
+ * left to be checked one at a time.  The listening daemon compiles all the
+ * lists when it loads its config file, so each connection inherits them. */
+struct trie_node {
+	int32 kid[2];
+	int end;
+};
+
+struct access_list {
+	char *list;
+	int refcnt;
+	item_list trie[2]; /* IPv4 & IPv6 trie_nodes */
+	struct hashtable *names;
+	item_list pats, dns_names;
+};
+
+static struct access_list **compiled_lists; /* an allow & a deny per module */
+static int compiled_cnt;
+
+static void trie_add(item_list *trie, const uchar *a, int bits)
 {
-	char *tok;
-	char *list2 = strdup(list);
+	struct trie_node *node;
+	int32 n = 0;
+	int i;
+
+	if (!trie->count) {
+		node = EXPAND_ITEM_LIST(trie, struct trie_node, 256);
+		memset(node, 0, sizeof node[0]);
+	}
+
+	for (i = 0; i < bits; i++) {
+		int bit = (a[i >> 3] >> (7 - (i & 7))) & 1;
+		node = (struct trie_node *)trie->items + n;
+		if (node->end) /* A shorter prefix already covers this one. */
+			return;
+		if (!node->kid[bit]) {
+			struct trie_node *kid = EXPAND_ITEM_LIST(trie, struct trie_node, 256);
+			memset(kid, 0, sizeof kid[0]);
+			node = (struct trie_node *)trie->items + n;
+			node->kid[bit] = trie->count - 1;
+		}
+		n = node->kid[bit];
+	}
+
+	node = (struct trie_node *)trie->items + n;
+	node->end = 1;
+}
+
+static int trie_match(item_list *trie, const uchar *a, int addrlen)
+{
+	struct trie_node *nodes = trie->items;
+	int32 n = 0;
+	int i;
+
+	if (!trie->count)
+		return 0;
+
+	for (i = 0; ; i++) {
+		if (nodes[n].end)
+			return 1;
+		if (i == addrlen << 3 || !(n = nodes[n].kid[(a[i >> 3] >> (7 - (i & 7))) & 1]))
+			return 0;
+	}
+}
+
+/* Returns the prefix length of a netmask, or -1 if it is not contiguous. */
+static int mask_bits(const uchar *mask, int addrlen)
+{
+	int i, bits = 0;
+
+	for (i = 0; i < addrlen && mask[i] == 0xff; i++)
+		bits += 8;
+	if (i < addrlen) {
+		uchar b = mask[i];
+		while (b & 0x80) {
+			b <<= 1;
+			bits++;
+		}
+		if (b)
+			return -1;
+		while (++i < addrlen) {
+			if (mask[i])
+				return -1;
+		}
+	}
+
+	return bits;
+}
+
+/* Adds an address entry to the trie.  Returns 1 on success, 0 if the entry
+ * needs to be matched the slow way, or -1 if it can never match. */
+static int add_address(struct access_list *al, char *tok)
+{
+	struct addrinfo hints, *res;
+	char *p = strchr(tok, '/');
+	uchar mask[16], *a;
+	int gai, addrlen, bits, idx, ret = -1;
+
+	if (p)
+		*p = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+#ifdef AI_NUMERICHOST
+	hints.ai_flags = AI_NUMERICHOST;
+#endif
+
+	gai = getaddrinfo(tok, NULL, &hints, &res);
+	if (p)
+		*p++ = '/';
+	if (gai != 0) {
+		rprintf(FLOG, "error matching address %s: %s\n",
+			tok, gai_strerror(gai));
+		return -1;
+	}
+
+	switch (res->ai_family) {
+	case PF_INET:
+		a = (uchar *)&((struct sockaddr_in *)res->ai_addr)->sin_addr;
+		addrlen = 4;
+		idx = 0;
+		break;
+
+#ifdef INET6
+	case PF_INET6: {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)res->ai_addr;
+#ifdef HAVE_SOCKADDR_IN6_SCOPE_ID
+		if (sin6->sin6_scope_id) {
+			ret = 0;
+			goto out;
+		}
+#endif
+		a = (uchar *)&sin6->sin6_addr;
+		addrlen = 16;
+		idx = 1;
+		break;
+	}
+#endif
+	default:
+		rprintf(FLOG, "unknown family %u\n", res->ai_family);
+		goto out;
+	}
+
+	if (!p)
+		bits = addrlen << 3;
+	else if (inet_pton(res->ai_family, p, mask) > 0) {
+		if ((bits = mask_bits(mask, addrlen)) < 0) {
+			ret = 0;
+			goto out;
+		}
+	} else {
+		char *ep = NULL;
+		long lbits = strtol(p, &ep, 10);
+		if (!*p || *ep || lbits < 0 || lbits > (addrlen << 3)) {
+			rprintf(FLOG, "malformed mask in %s\n", tok);
+			goto out;
+		}
+		bits = lbits;
+	}
+
+	trie_add(&al->trie[idx], a, bits);
+	ret = 1;
+
+  out:
+	freeaddrinfo(res);
+	return ret;
+}
+
+static void add_name(struct access_list *al, char *tok)
+{
+	int32 key = hashlittle(tok, strlen(tok));
+	struct ht_int32_node *node = hashtable_find(al->names, key ? key : 1, (void*)-1L);
+
+	if (node->data == (void*)-1L)
+		node->data = strdup(tok);
+	else if (strcmp(node->data, tok) != 0) /* A hash collision. */
+		*EXPAND_ITEM_LIST(&al->pats, char *, 16) = strdup(tok);
+}
+
+static struct access_list *compile_access_list(const char *list)
+{
+	struct access_list *al = new0(struct access_list);
+	char *list2 = strdup(list), *tok;
+
+	al->list = strdup(list);
+	al->refcnt = 1;
+	al->names = hashtable_create(512, HT_KEY32);
 
 	strlower(list2);
 
 	for (tok = strtok(list2, " ,\t"); tok; tok = strtok(NULL, " ,\t")) {
-		if (match_hostname(host_ptr, addr, tok) || match_address(addr, tok)) {
-			free(list2);
-			return 1;
+		char *slash = strchr(tok, '/');
+		int is_addr, wild = tok[strcspn(tok, "*?[\\")] != '\0';
+#ifdef HAVE_INNETGR
+		if (*tok == '@' && tok[1])
+			wild = 1;
+#endif
+		if (slash)
+			*slash = '\0';
+		is_addr = !tok[strspn(tok, ".0123456789")] || strchr(tok, ':') != NULL;
+		if (slash)
+			*slash = '/';
+
+		if (wild || (is_addr && add_address(al, tok) == 0)) {
+			*EXPAND_ITEM_LIST(&al->pats, char *, 16) = strdup(tok);
+			continue;
 		}
+		add_name(al, tok);
+		if (tok[strspn(tok, ".0123456789")] && !tok[strcspn(tok, ":/*?[")])
+			*EXPAND_ITEM_LIST(&al->dns_names, char *, 16) = strdup(tok);
 	}
 
 	free(list2);
+	return al;
+}
+
+static void free_access_list(struct access_list *al)
+{
+	size_t j;
+	int32 i;
+
+	if (!al || --al->refcnt > 0)
+		return;
+
+	for (i = 0; i < al->names->size; i++) {
+		struct ht_int32_node *node = HT_NODE(al->names, al->names->nodes, i);
+		if (node->key && node->data)
+			free(node->data);
+	}
+	hashtable_destroy(al->names);
+	for (j = 0; j < al->pats.count; j++)
+		free(((char **)al->pats.items)[j]);
+	for (j = 0; j < al->dns_names.count; j++)
+		free(((char **)al->dns_names.items)[j]);
+	free(al->pats.items);
+	free(al->dns_names.items);
+	free(al->trie[0].items);
+	free(al->trie[1].items);
+	free(al->list);
+	free(al);
+}
+
+static struct access_list *find_access_list(const char *list, int upto)
+{
+	int j;
+
+	for (j = 0; j < upto; j++) {
+		if (compiled_lists[j] && strcmp(compiled_lists[j]->list, list) == 0) {
+			compiled_lists[j]->refcnt++;
+			return compiled_lists[j];
+		}
+	}
+
+	return compile_access_list(list);
+}
+
+/* Called by the listening daemon after it (re)loads its config file.
+ * Modules that have the same list share the compiled version.  A list
+ * that still has a %VAR% in it is left for each connection to compile,
+ * since its process expands the list with its own RSYNC_* variables. */
+void compile_access_lists(void)
+{
+	int i, j;
+
+	for (j = 0; j < compiled_cnt; j++)
+		free_access_list(compiled_lists[j]);
+
+	compiled_cnt = lp_num_modules() * 2;
+	compiled_lists = realloc_array(compiled_lists, struct access_list *, compiled_cnt + 1);
+
+	for (i = 0, j = 0; j < compiled_cnt; i++) {
+		const char *allow_list = lp_hosts_allow(i);
+		const char *deny_list = lp_hosts_deny(i);
+		compiled_lists[j] = allow_list && *allow_list && !strchr(allow_list, '%')
+				  ? find_access_list(allow_list, j) : NULL;
+		j++;
+		compiled_lists[j] = deny_list && *deny_list && !strchr(deny_list, '%')
+				  ? find_access_list(deny_list, j) : NULL;
+		j++;
+	}
+}
+
+static struct access_list *get_access_list(const char *list, int ndx)
+{
+	if (!list || !*list)
+		return NULL;
+
+	/* The list came from the same config we compiled, unless this is an
+	 * inetd daemon (or the like) that never compiled anything. */
+	if (ndx < compiled_cnt) {
+		if (compiled_lists[ndx] && strcmp(compiled_lists[ndx]->list, list) == 0)
+			return compiled_lists[ndx];
+		free_access_list(compiled_lists[ndx]);
+	} else {
+		compiled_lists = realloc_array(compiled_lists, struct access_list *, ndx + 1);
+		memset(compiled_lists + compiled_cnt, 0, (ndx + 1 - compiled_cnt) * sizeof compiled_lists[0]);
+		compiled_cnt = ndx + 1;
+	}
+
+	return compiled_lists[ndx] = compile_access_list(list);
+}
+
+static int access_match(struct access_list *al, const uchar *a, int family,
+			const char *addr, const char **host_ptr)
+{
+	const char *host = *host_ptr;
+	size_t j;
+
+	if ((family == PF_INET && trie_match(&al->trie[0], a, 4))
+#ifdef INET6
+	 || (family == PF_INET6 && trie_match(&al->trie[1], a, 16))
+#endif
+	) return 1;
+
+	if (host && *host) {
+		char name[1024];
+		if (strlcpy(name, host, sizeof name) < sizeof name) {
+			int32 key;
+			struct ht_int32_node *node;
+			strlower(name);
+			key = hashlittle(name, strlen(name));
+			node = hashtable_find(al->names, key ? key : 1, NULL);
+			if (node && strcmp(node->data, name) == 0)
+				return 1;
+		}
+	}
+
+	for (j = 0; j < al->pats.count; j++) {
+		char *tok = ((char **)al->pats.items)[j];
+		if (match_hostname(host_ptr, addr, tok) || match_address(addr, tok))
+			return 1;
+	}
+
+	if (allow_forward_dns) {
+		for (j = 0; j < al->dns_names.count; j++) {
+			if (match_hostname(host_ptr, addr, ((char **)al->dns_names.items)[j]))
+				return 1;
+		}
+	}
+
 	return 0;
 }
 
 int allow_access(const char *addr, const char **host_ptr, int i)
 {
-	const char *allow_list = lp_hosts_allow(i);
-	const char *deny_list = lp_hosts_deny(i);
-
-	if (allow_list && !*allow_list)
-		allow_list = NULL;
-	if (deny_list && !*deny_list)
-		deny_list = NULL;
+	struct access_list *allow_list = get_access_list(lp_hosts_allow(i), i * 2);
+	struct access_list *deny_list = get_access_list(lp_hosts_deny(i), i * 2 + 1);
+	struct addrinfo hints, *res = NULL;
+	const uchar *a = NULL;
+	int family = PF_UNSPEC;
+	int ret = 1;
 
 	allow_forward_dns = lp_forward_lookup(i);
 
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+#ifdef AI_NUMERICHOST
+	hints.ai_flags = AI_NUMERICHOST;
+#endif
+
+	if ((allow_list || deny_list) && addr && *addr
+	 && getaddrinfo(addr, NULL, &hints, &res) == 0) {
+		family = res->ai_family;
+		if (family == PF_INET)
+			a = (uchar *)&((struct sockaddr_in *)res->ai_addr)->sin_addr;
+#ifdef INET6
+		else if (family == PF_INET6)
+			a = (uchar *)&((struct sockaddr_in6 *)res->ai_addr)->sin6_addr;
+#endif
+	}
+
 	/* If we match an allow-list item, we always allow access. */
 	if (allow_list) {
-		if (access_match(allow_list, addr, host_ptr))
-			return 1;
+		if (access_match(allow_list, a, family, addr, host_ptr))
+			goto out;
 		/* For an allow-list w/o a deny-list, disallow non-matches. */
-		if (!deny_list)
-			return 0;
+		if (!deny_list) {
+			ret = 0;
+			goto out;
+		}
 	}
 
 	/* If we match a deny-list item (and got past any allow-list
 	 * items), we always disallow access. */
-	if (deny_list && access_match(deny_list, addr, host_ptr))
-		return 0;
+	if (deny_list && access_match(deny_list, a, family, addr, host_ptr))
+		ret = 0;
 
 	/* Allow all other access. */
-	return 1;
+  out:
+	if (res)
+		freeaddrinfo(res);
+	return ret;
 }
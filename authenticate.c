@@ -94,6 +94,246 @@ static void generate_hash(const char *in, const char *challenge, char *out)
 	base64_encode(buf, len, out, 0);
 }
 
+/* A listening daemon reads each module's secrets file up front, hashing the
+ * first "name:password" line of each user and @group, so that a connection
+ * doesn't need to scan a big file.  A connection still opens the file (so
+ * the usual permission checks apply) and only uses the cached lines if the
+ * file it opened is the same unchanged file that we read.  A file that was
+ * changed within a second of our read isn't cached yet, since a change in
+ * the same second (that kept its size) would look unchanged; we try again
+ * before a later connection. */
+struct secrets_cache {
+	struct secrets_cache *next;
+	char *fname;
+	STRUCT_STAT st;
+	struct hashtable *tbl; /* the hash of "name" or "@group" -> line, or NULL */
+};
+
+static struct secrets_cache *secrets_caches;
+
+static int32 secret_key(const char *prefix, const char *name, int len)
+{
+	char buf[1024];
+	int32 key;
+
+	len = snprintf(buf, sizeof buf, "%s%.*s", prefix, len, name);
+	key = hashlittle(buf, MIN(len, (int)sizeof buf - 1));
+
+	return key ? key : 1; /* hashtable_find() doesn't like a 0 key. */
+}
+
+static int same_file(STRUCT_STAT *st1, STRUCT_STAT *st2)
+{
+	return st1->st_dev == st2->st_dev && st1->st_ino == st2->st_ino
+	    && st1->st_size == st2->st_size && st1->st_mtime == st2->st_mtime
+#ifdef ST_MTIME_NSEC
+	    && st1->ST_MTIME_NSEC == st2->ST_MTIME_NSEC
+#endif
+	    && st1->st_ctime == st2->st_ctime;
+}
+
+static void free_secrets_lines(struct secrets_cache *sc)
+{
+	int32 i;
+
+	for (i = 0; i < sc->tbl->size; i++) {
+		struct ht_int32_node *node = HT_NODE(sc->tbl, sc->tbl->nodes, i);
+		if (node->key && node->data) {
+			force_memzero(node->data, strlen(node->data));
+			free(node->data);
+		}
+	}
+	hashtable_destroy(sc->tbl);
+	sc->tbl = NULL;
+}
+
+static void free_secrets_cache(struct secrets_cache *sc)
+{
+	if (sc->tbl)
+		free_secrets_lines(sc);
+	free(sc->fname);
+	free(sc);
+}
+
+static int read_secrets_cache(struct secrets_cache *sc)
+{
+	char line[1024];
+	FILE *fh;
+
+	if ((fh = fopen(sc->fname, "r")) == NULL)
+		return 0;
+	if (do_fstat(fileno(fh), &sc->st) < 0) {
+		fclose(fh);
+		return 0;
+	}
+	if (sc->st.st_mtime >= time(NULL) - 1) {
+		fclose(fh);
+		return 1;
+	}
+
+	sc->tbl = hashtable_create(1024, HT_KEY32);
+	while (fgets(line, sizeof line, fh) != NULL) {
+		struct ht_int32_node *node;
+		char *s = strtok(line, "\n\r"), *colon;
+		if (!s || *s == '#' || !(colon = strchr(s, ':')))
+			continue;
+		node = hashtable_find(sc->tbl, secret_key("", s, colon - s), (void*)-1L);
+		if (node->data == (void*)-1L)
+			node->data = strdup(s);
+	}
+
+	fclose(fh);
+	force_memzero(line, sizeof line);
+
+	return 1;
+}
+
+/* Called by the listening daemon after it (re)loads its config (FORCE), or
+ * before it forks for a connection, to re-read any changed secrets file.
+ * Returns True if the cached data changed. */
+int cache_secrets_files(int force)
+{
+	struct secrets_cache *sc, **scp;
+	int changed = 0, i;
+
+	if (force) {
+		while ((sc = secrets_caches) != NULL) {
+			secrets_caches = sc->next;
+			free_secrets_cache(sc);
+		}
+		for (i = 0; i < lp_num_modules(); i++) {
+			char *fname = lp_secrets_file(i);
+			/* A name with a %VAR% reference depends on the connection. */
+			if (!fname || !*fname || strchr(fname, '%'))
+				continue;
+			for (sc = secrets_caches; sc; sc = sc->next) {
+				if (strcmp(sc->fname, fname) == 0)
+					break;
+			}
+			if (sc)
+				continue;
+			sc = new0(struct secrets_cache);
+			sc->fname = strdup(fname);
+			if (!read_secrets_cache(sc)) {
+				free_secrets_cache(sc);
+				continue;
+			}
+			sc->next = secrets_caches;
+			secrets_caches = sc;
+		}
+		return True;
+	}
+
+	for (scp = &secrets_caches; (sc = *scp) != NULL; ) {
+		STRUCT_STAT st;
+		int was_cached = sc->tbl != NULL;
+		if (was_cached && do_stat(sc->fname, &st) == 0 && same_file(&st, &sc->st)) {
+			scp = &sc->next;
+			continue;
+		}
+		if (was_cached)
+			free_secrets_lines(sc);
+		if (read_secrets_cache(sc)) {
+			if (was_cached || sc->tbl)
+				changed = 1;
+			scp = &sc->next;
+		} else {
+			*scp = sc->next;
+			free_secrets_cache(sc);
+			if (was_cached)
+				changed = 1;
+		}
+	}
+
+	return changed;
+}
+
+/* A connection's process only keeps the cached secrets of its own module, so
+ * that it doesn't hold the passwords of every module in its memory. */
+void trim_secrets_cache(int module)
+{
+	char *fname = lp_secrets_file(module);
+	struct secrets_cache *sc, **scp;
+
+	for (scp = &secrets_caches; (sc = *scp) != NULL; ) {
+		if (fname && strcmp(sc->fname, fname) == 0) {
+			scp = &sc->next;
+			continue;
+		}
+		*scp = sc->next;
+		free_secrets_cache(sc);
+	}
+}
+
+static struct secrets_cache *find_secrets_cache(const char *fname, STRUCT_STAT *st)
+{
+	struct secrets_cache *sc;
+
+	for (sc = secrets_caches; sc; sc = sc->next) {
+		if (strcmp(sc->fname, fname) == 0)
+			return sc->tbl && same_file(st, &sc->st) ? sc : NULL;
+	}
+
+	return NULL;
+}
+
+/* Sets *secret_ptr to the password of the user (or the @group if prefix is
+ * "@"), or to NULL if there isn't one.  Returns 0 if a hash collision
+ * means that we need to scan the file after all. */
+static int cached_secret(struct secrets_cache *sc, const char *prefix, const char *name,
+			 const char **secret_ptr)
+{
+	int len = strlen(name);
+	struct ht_int32_node *node = hashtable_find(sc->tbl, secret_key(prefix, name, len), NULL);
+	const char *s;
+
+	*secret_ptr = NULL;
+	if (!node)
+		return 1;
+	s = node->data;
+	if (*prefix ? *s++ != '@' : *s == '@')
+		return 0;
+	if (strncmp(s, name, len) != 0 || s[len] != ':')
+		return 0;
+	*secret_ptr = s + len + 1;
+
+	return 1;
+}
+
+/* Checks the user and group against the cached secrets, setting *err_ptr
+ * to NULL on success or to an error string.  Returns 0 if we need to scan
+ * the file instead. */
+static int check_cached_secret(struct secrets_cache *sc, const char *user, const char *group,
+			       const char *challenge, const char *pass, const char **err_ptr)
+{
+	const char *secrets[2], *err = "secret not found";
+	char pass2[MAX_DIGEST_LEN*2];
+	int j;
+
+	if (!cached_secret(sc, "", user, &secrets[0]))
+		return 0;
+	if (!group)
+		secrets[1] = NULL;
+	else if (!cached_secret(sc, "@", group, &secrets[1]))
+		return 0;
+
+	for (j = 0; j < 2; j++) {
+		if (!secrets[j])
+			continue;
+		generate_hash(secrets[j], challenge, pass2);
+		if (strcmp(pass, pass2) == 0) {
+			err = NULL;
+			break;
+		}
+		err = "password mismatch";
+	}
+
+	force_memzero(pass2, sizeof pass2);
+	*err_ptr = err;
+
+	return 1;
+}
+
 /* Return the secret for a user from the secret file, null terminated.
  * Maximum length is len (not counting the null). */
 static const char *check_secret(int module, const char *user, const char *group,
@@ -106,6 +346,8 @@ static const char *check_secret(int module, const char *user, const char *group,
 	int ok = 1;
 	int user_len = strlen(user);
 	int group_len = group ? strlen(group) : 0;
+	struct secrets_cache *sc;
+	const char *cached_err;
 	char *err;
 	FILE *fh;
 
@@ -135,6 +377,12 @@ static const char *check_secret(int module, const char *user, const char *group,
 		return "invalid username";
 	}
 
+	if ((sc = find_secrets_cache(fname, &st)) != NULL
+	 && check_cached_secret(sc, user, group, challenge, pass, &cached_err)) {
+		fclose(fh);
+		return cached_err;
+	}
+
 	/* Try to find a line that starts with the user (or @group) name and a ':'. */
 	err = "secret not found";
 	while ((user || group) && fgets(line, sizeof line, fh) != NULL) {
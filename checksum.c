@@ -27,6 +27,10 @@
  */
 
 #include "rsync.h"
+#include "inums.h"
+#ifdef SUPPORT_SUM_THREAD
+#include <pthread.h>
+#endif
 
 #ifdef SUPPORT_XXHASH
 #include <xxhash.h>
@@ -36,6 +40,9 @@
 #endif
 
 extern int am_server;
+extern int am_daemon;
+extern int am_sender;
+extern int module_id;
 extern int whole_file;
 extern int checksum_seed;
 extern int protocol_version;
@@ -299,15 +306,208 @@ void get_checksum2(char *buf, int32 len, char *sum)
 	}
 }
 
+/* A listening daemon with a "checksum cache size" shares a table of
+ * whole-file checksums with its connection processes, so the sender of a
+ * module with "checksum cache" enabled need not re-read a file that some
+ * connection has already summed.  The table is split into a page-aligned
+ * part for each such module, and a connection unmaps all but its module's
+ * part before it goes on, so it can't affect the sums that other modules
+ * use.  A slot is picked by a hash of the file's dev & inode, and its sum
+ * is only used if the module, checksum type, size, mtime, and ctime all
+ * match.  A busy slot is treated as a miss. */
+struct csum_cache_slot {
+	volatile pid_t lock;
+	int32 sum_type;
+	uint32 module;
+	uint32 mtime_nsec;
+	int64 dev, ino, size;
+	int64 mtime, ctime;
+	char sum[MAX_DIGEST_LEN];
+};
+
+#ifdef SUPPORT_SHARED_TABLES
+static char *csum_cache_map;
+static size_t csum_cache_map_len, csum_cache_part_len;
+static int *csum_cache_parts; /* each module's part number, or -1 */
+#endif
+static struct csum_cache_slot *csum_cache;
+static size_t csum_cache_slots;
+static int64 csum_cache_hits, csum_cache_misses;
+
+/* Called by the listening daemon after it (re)loads its config file.  A
+ * new size starts an empty table, but running connections keep theirs. */
+void checksum_cache_init(void)
+{
+#ifdef SUPPORT_SHARED_TABLES
+	int size = lp_checksum_cache_size();
+	size_t page_len = sysconf(_SC_PAGESIZE);
+	size_t len = size > 0 ? (size_t)size * 1024 / page_len * page_len : 0;
+	int i, parts = 0;
+
+	csum_cache_parts = realloc_array(csum_cache_parts, int, lp_num_modules() + 1);
+	for (i = 0; i < lp_num_modules(); i++)
+		csum_cache_parts[i] = lp_checksum_cache(i) ? parts++ : -1;
+	csum_cache_part_len = parts ? len / parts / page_len * page_len : 0;
+
+	if (len != csum_cache_map_len) {
+		if (csum_cache_map) {
+			munmap(csum_cache_map, csum_cache_map_len);
+			csum_cache_map = NULL;
+			csum_cache_map_len = 0;
+		}
+		if (!len)
+			return;
+		csum_cache_map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (csum_cache_map == MAP_FAILED) {
+			rsyserr(FLOG, errno, "unable to map the checksum cache");
+			csum_cache_map = NULL;
+			return;
+		}
+		csum_cache_map_len = len;
+	}
+#endif
+}
+
+/* Called in a connection once its module is known, before it reads the
+ * client's request.  It keeps only the module's part of the table. */
+void checksum_cache_setup(int i)
+{
+#ifdef SUPPORT_SHARED_TABLES
+	size_t start;
+
+	if (!csum_cache_map)
+		return;
+
+	if (csum_cache_parts[i] < 0 || csum_cache_part_len < sizeof csum_cache[0]) {
+		munmap(csum_cache_map, csum_cache_map_len);
+		csum_cache_map = NULL;
+		return;
+	}
+
+	start = csum_cache_parts[i] * csum_cache_part_len;
+	if (start)
+		munmap(csum_cache_map, start);
+	if (start + csum_cache_part_len < csum_cache_map_len) {
+		munmap(csum_cache_map + start + csum_cache_part_len,
+		       csum_cache_map_len - start - csum_cache_part_len);
+	}
+
+	csum_cache = (struct csum_cache_slot *)(csum_cache_map + start);
+	csum_cache_slots = csum_cache_part_len / sizeof csum_cache[0];
+#else
+	(void)i;
+#endif
+}
+
+static int csum_cache_enabled(void)
+{
+	return csum_cache && am_daemon && am_sender && lp_checksum_cache(module_id);
+}
+
+static struct csum_cache_slot *csum_cache_lock(const STRUCT_STAT *st_p)
+{
+	struct csum_cache_slot *slot;
+	int64 id[2];
+
+	id[0] = st_p->st_dev;
+	id[1] = st_p->st_ino;
+	slot = csum_cache + hashlittle(id, sizeof id) % csum_cache_slots;
+	if (!shared_trylock(&slot->lock))
+		return NULL;
+
+	return slot;
+}
+
+static void csum_cache_unlock(struct csum_cache_slot *slot)
+{
+	shared_unlock(&slot->lock);
+}
+
+static uint32 csum_cache_module(void)
+{
+	return hashlittle(lp_name(module_id), strlen(lp_name(module_id)));
+}
+
+static int csum_cache_get(const STRUCT_STAT *st_p, char *sum)
+{
+	struct csum_cache_slot *slot;
+	int found = 0;
+
+	if (!csum_cache_enabled())
+		return 0;
+
+	if ((slot = csum_cache_lock(st_p)) != NULL) {
+		if (slot->sum_type == checksum_type && slot->module == csum_cache_module()
+		 && slot->dev == (int64)st_p->st_dev && slot->ino == (int64)st_p->st_ino
+		 && slot->size == (int64)st_p->st_size && slot->mtime == (int64)st_p->st_mtime
+		 && slot->ctime == (int64)st_p->st_ctime
+#ifdef ST_MTIME_NSEC
+		 && slot->mtime_nsec == (uint32)st_p->ST_MTIME_NSEC
+#endif
+		) {
+			memcpy(sum, slot->sum, MAX_DIGEST_LEN);
+			found = 1;
+		}
+		csum_cache_unlock(slot);
+	}
+
+	if (found)
+		csum_cache_hits++;
+	else
+		csum_cache_misses++;
+
+	return found;
+}
+
+static void csum_cache_put(const STRUCT_STAT *st_p, const char *sum)
+{
+	struct csum_cache_slot *slot;
+
+	if (!csum_cache_enabled() || !(slot = csum_cache_lock(st_p)))
+		return;
+
+	slot->sum_type = checksum_type;
+	slot->module = csum_cache_module();
+	slot->dev = st_p->st_dev;
+	slot->ino = st_p->st_ino;
+	slot->size = st_p->st_size;
+	slot->mtime = st_p->st_mtime;
+	slot->ctime = st_p->st_ctime;
+#ifdef ST_MTIME_NSEC
+	slot->mtime_nsec = st_p->ST_MTIME_NSEC;
+#else
+	slot->mtime_nsec = 0;
+#endif
+	memcpy(slot->sum, sum, MAX_DIGEST_LEN);
+
+	csum_cache_unlock(slot);
+}
+
+/* Logs how well the checksum cache did for this connection. */
+void log_checksum_cache(void)
+{
+	int64 total = csum_cache_hits + csum_cache_misses;
+
+	if (total)
+		rprintf(FLOG, "checksum cache: %s hits, %s misses (%d%% hit rate)\n",
+			big_num(csum_cache_hits), big_num(csum_cache_misses),
+			(int)(csum_cache_hits * 100 / total));
+}
+
 void file_checksum(const char *fname, const STRUCT_STAT *st_p, char *sum)
 {
 	struct map_struct *buf;
 	OFF_T i, len = st_p->st_size;
 	int32 remainder;
-	int fd;
+	STRUCT_STAT st;
+	int fd, unchanged;
 
 	memset(sum, 0, MAX_DIGEST_LEN);
 
+	if (csum_cache_get(st_p, sum))
+		return;
+
 	fd = do_open(fname, O_RDONLY, 0);
 	if (fd == -1)
 		return;
@@ -433,8 +633,20 @@ void file_checksum(const char *fname, const STRUCT_STAT *st_p, char *sum)
 		exit_cleanup(RERR_UNSUPPORTED);
 	}
 
+	/* Only a sum of the whole, unchanged file can be shared: a read error
+	 * leaves zeros in the mapped data, and a file that changed while we
+	 * read it may not match its old stat info. */
+	unchanged = csum_cache_enabled() && do_fstat(fd, &st) == 0
+		 && st.st_size == st_p->st_size && st.st_mtime == st_p->st_mtime
+		 && st.st_ctime == st_p->st_ctime
+#ifdef ST_MTIME_NSEC
+		 && st.ST_MTIME_NSEC == st_p->ST_MTIME_NSEC
+#endif
+		 ;
+
 	close(fd);
-	unmap_file(buf);
+	if (unmap_file(buf) == 0 && unchanged)
+		csum_cache_put(st_p, sum);
 }
 
 static int32 sumresidue;
@@ -507,6 +719,126 @@ void sum_init(int csum_type, int seed)
 	}
 }
 
+#ifdef SUPPORT_SUM_THREAD
+/* A big file's whole-file digest can be computed by a hashing thread while
+ * the sender matches blocks or the receiver writes data.  sum_update() then
+ * copies the data into a ring that the thread hashes, since the map_ptr()
+ * windows and the receiver's input buffer are reused as soon as we return.
+ * Only the digests whose code keeps its state in the context (MD5, and MD4
+ * from OpenSSL) are handed over; the xxhash digests are already faster than
+ * the copy.  The thread is joined by sum_end(), so none is left running when
+ * a process forks. */
+#define SUM_RING_SIZE (4*1024*1024)
+#define SUM_THREAD_MIN_LEN (1024*1024)
+
+static void sum_update_now(const char *p, int32 len);
+
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *buf;
+	size_t head, tail; /* Byte counts that the ring positions are taken from. */
+	int active, done;
+} sum_ring = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static void *sum_thread_main(UNUSED(void *arg))
+{
+	pthread_mutex_lock(&sum_ring.lock);
+	while (1) {
+		size_t off, len;
+		while (sum_ring.head == sum_ring.tail && !sum_ring.done)
+			pthread_cond_wait(&sum_ring.cond, &sum_ring.lock);
+		if (sum_ring.head == sum_ring.tail)
+			break;
+		off = sum_ring.tail % SUM_RING_SIZE;
+		len = MIN(sum_ring.head - sum_ring.tail, SUM_RING_SIZE - off);
+		pthread_mutex_unlock(&sum_ring.lock);
+
+		sum_update_now(sum_ring.buf + off, len);
+
+		pthread_mutex_lock(&sum_ring.lock);
+		sum_ring.tail += len;
+		pthread_cond_broadcast(&sum_ring.cond);
+	}
+	pthread_mutex_unlock(&sum_ring.lock);
+
+	return NULL;
+}
+
+static void sum_ring_put(const char *p, int32 len)
+{
+	while (len > 0) {
+		size_t off, n;
+		pthread_mutex_lock(&sum_ring.lock);
+		while (sum_ring.head - sum_ring.tail == SUM_RING_SIZE)
+			pthread_cond_wait(&sum_ring.cond, &sum_ring.lock);
+		off = sum_ring.head % SUM_RING_SIZE;
+		n = MIN((size_t)len, SUM_RING_SIZE - (sum_ring.head - sum_ring.tail));
+		n = MIN(n, SUM_RING_SIZE - off);
+		pthread_mutex_unlock(&sum_ring.lock);
+
+		memcpy(sum_ring.buf + off, p, n);
+
+		pthread_mutex_lock(&sum_ring.lock);
+		sum_ring.head += n;
+		pthread_cond_broadcast(&sum_ring.cond);
+		pthread_mutex_unlock(&sum_ring.lock);
+		p += n;
+		len -= n;
+	}
+}
+
+static void sum_ring_finish(void)
+{
+	pthread_mutex_lock(&sum_ring.lock);
+	sum_ring.done = 1;
+	pthread_cond_broadcast(&sum_ring.cond);
+	pthread_mutex_unlock(&sum_ring.lock);
+
+	pthread_join(sum_ring.thread, NULL);
+	sum_ring.active = 0;
+}
+#endif
+
+/* Like sum_init(), but the digest of a file of len bytes may be computed by
+ * a hashing thread so that it overlaps the caller's matching and I/O. */
+void sum_init_threaded(int csum_type, int seed, OFF_T len)
+{
+#ifdef SUPPORT_SUM_THREAD
+	sigset_t all, old;
+#endif
+
+	sum_init(csum_type, seed);
+
+#ifdef SUPPORT_SUM_THREAD
+	if (len < SUM_THREAD_MIN_LEN)
+		return;
+	switch (cursum_type) {
+	  case CSUM_MD5:
+#ifdef USE_OPENSSL
+	  case CSUM_MD4:
+#endif
+		break;
+	  default:
+		return;
+	}
+
+	if (!sum_ring.buf)
+		sum_ring.buf = new_array(char, SUM_RING_SIZE);
+	sum_ring.head = sum_ring.tail = 0;
+	sum_ring.done = 0;
+
+	/* Our signal handlers must only run in the main thread. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	sum_ring.active = pthread_create(&sum_ring.thread, NULL, sum_thread_main, NULL) == 0;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+#else
+	(void)len;
+#endif
+}
+
 /**
  * Feed data into an MD4 accumulator, md.  The results may be
  * retrieved using sum_end().  md is used for different purposes at
@@ -515,7 +847,7 @@ void sum_init(int csum_type, int seed)
  * @todo Perhaps get rid of md and just pass in the address each time.
  * Very slightly clearer and slower.
  **/
-void sum_update(const char *p, int32 len)
+static void sum_update_now(const char *p, int32 len)
 {
 	switch (cursum_type) {
 #ifdef SUPPORT_XXHASH
@@ -573,12 +905,28 @@ void sum_update(const char *p, int32 len)
 	}
 }
 
+void sum_update(const char *p, int32 len)
+{
+#ifdef SUPPORT_SUM_THREAD
+	if (sum_ring.active) {
+		sum_ring_put(p, len);
+		return;
+	}
+#endif
+	sum_update_now(p, len);
+}
+
 /* NOTE: all the callers of sum_end() pass in a pointer to a buffer that is
  * MAX_DIGEST_LEN in size, so even if the csum-len is shorter that that (i.e.
  * CSUM_MD4_ARCHAIC), we don't have to worry about limiting the data we write
  * into the "sum" buffer. */
 int sum_end(char *sum)
 {
+#ifdef SUPPORT_SUM_THREAD
+	if (sum_ring.active)
+		sum_ring_finish();
+#endif
+
 	switch (cursum_type) {
 #ifdef SUPPORT_XXHASH
 	  case CSUM_XXH64:
@@ -206,6 +206,7 @@ NORETURN void _exit_cleanup(int code, const char *file, int line)
 			if (pidf && *pidf)
 				unlink(lp_pid_file());
 		}
+		metrics_cleanup();
 
 		if (exit_code == 0) {
 			if (code)
@@ -224,6 +225,8 @@ NORETURN void _exit_cleanup(int code, const char *file, int line)
 		 || am_daemon || (logfile_name && (am_server || !INFO_GTE(STATS, 1)))) {
 			log_exit(exit_code, exit_file, exit_line);
 		}
+		if (am_daemon > 0)
+			metrics_report(exit_code);
 
 #include "case_N.h"
 		switch_step++;
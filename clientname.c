@@ -36,6 +36,25 @@ static const char proxyv2sig[] = "\r\n\r\n\0\r\nQUIT\n";
 
 static char ipaddr_buf[100];
 
+/* With "name cache time" set, the listening daemon maps a table that all its
+ * connection processes share, which remembers the name of recently seen
+ * addresses (or that the lookup failed) so that a busy daemon doesn't repeat
+ * the same slow reverse lookups.  Since any connection process can write the
+ * table, a cached name only replaces the reverse lookup: it still gets the
+ * forward check before it is used.  Each slot has a lock that a process only
+ * tries to take, so a busy slot is just treated as a miss. */
+#define NAME_CACHE_SLOTS 4096
+#define NAME_CACHE_NEGATIVE_TIME 60
+
+struct name_cache_slot {
+	volatile pid_t lock;
+	time_t expires;
+	char addr[48];
+	char name[100];
+};
+
+static struct name_cache_slot *name_cache;
+
 #define PROXY_V2_SIG_SIZE ((int)sizeof proxyv2sig - 1)
 #define PROXY_V2_HEADER_SIZE (PROXY_V2_SIG_SIZE + 1 + 1 + 2)
 
@@ -84,6 +103,158 @@ char *client_addr(int fd)
 }
 
 
+/* The reverse lookup, plus the forward lookup that verifies it.  If CACHED
+ * is set, name_buf already holds a name from the name cache to verify. */
+static void lookup_name(const char *ipaddr, const struct sockaddr_storage *ss, socklen_t ss_len,
+			char *name_buf, size_t name_buf_size, int cached)
+{
+	char port_buf[100];
+	int err;
+
+	err = cached ? 0 : getnameinfo((struct sockaddr*)ss, ss_len, name_buf, name_buf_size,
+				       port_buf, sizeof port_buf, NI_NAMEREQD | NI_NUMERICSERV);
+	if (err) {
+		strlcpy(name_buf, default_name, name_buf_size);
+		rprintf(FLOG, "name lookup failed for %s: %s\n", ipaddr, gai_strerror(err));
+	} else
+		check_name(ipaddr, ss, name_buf, name_buf_size);
+}
+
+/* The resolver functions can't be interrupted, so a lookup with a time
+ * limit is done by a child process that we kill if it takes too long. */
+static void lookup_name_with_timeout(const char *ipaddr, const struct sockaddr_storage *ss, socklen_t ss_len,
+				     char *name_buf, size_t name_buf_size, int cached)
+{
+	int fds[2], len = 0, n;
+	time_t stop = time(NULL) + lp_name_lookup_timeout();
+	pid_t pid;
+
+	if (fd_pair(fds) < 0 || (pid = fork()) < 0) {
+		lookup_name(ipaddr, ss, ss_len, name_buf, name_buf_size, cached);
+		return;
+	}
+
+	if (pid == 0) {
+		close(fds[0]);
+		lookup_name(ipaddr, ss, ss_len, name_buf, name_buf_size, cached);
+		if (write(fds[1], name_buf, strlen(name_buf)) < 0) {}
+		_exit(0);
+	}
+
+	close(fds[1]);
+	while (len < (int)name_buf_size - 1) {
+		struct timeval tv;
+		fd_set r_fds;
+		time_t now = time(NULL);
+
+		if (now >= stop) {
+			rprintf(FLOG, "name lookup timed out for %s\n", ipaddr);
+			kill(pid, SIGKILL);
+			len = 0;
+			break;
+		}
+		FD_ZERO(&r_fds);
+		FD_SET(fds[0], &r_fds);
+		tv.tv_sec = stop - now;
+		tv.tv_usec = 0;
+		if (select(fds[0] + 1, &r_fds, NULL, NULL, &tv) <= 0)
+			continue;
+		if ((n = read(fds[0], name_buf + len, name_buf_size - 1 - len)) <= 0)
+			break;
+		len += n;
+	}
+	close(fds[0]);
+	waitpid(pid, NULL, 0);
+
+	if (len)
+		name_buf[len] = '\0';
+	else
+		strlcpy(name_buf, default_name, name_buf_size);
+}
+
+/* Called by the listening daemon (before it starts any connection
+ * processes) to set up the shared name cache. */
+void name_cache_init(void)
+{
+#ifdef SUPPORT_SHARED_TABLES
+	void *map;
+
+	if (name_cache || lp_name_cache_time() <= 0)
+		return;
+
+	map = mmap(NULL, NAME_CACHE_SLOTS * sizeof name_cache[0], PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		rsyserr(FLOG, errno, "unable to map the name cache");
+	else
+		name_cache = map;
+#endif
+}
+
+static struct name_cache_slot *name_cache_lock(const char *ipaddr)
+{
+	struct name_cache_slot *slot;
+
+	if (!name_cache || lp_name_cache_time() <= 0)
+		return NULL;
+
+	slot = name_cache + hashlittle(ipaddr, strlen(ipaddr)) % NAME_CACHE_SLOTS;
+	if (!shared_trylock(&slot->lock))
+		return NULL;
+
+	return slot;
+}
+
+static void name_cache_unlock(struct name_cache_slot *slot)
+{
+	shared_unlock(&slot->lock);
+}
+
+static int name_cache_get(const char *ipaddr, char *name_buf, size_t name_buf_size)
+{
+	struct name_cache_slot *slot = name_cache_lock(ipaddr);
+	time_t now = time(NULL);
+	int found = 0;
+
+	if (!slot)
+		return 0;
+
+	/* An entry that would outlive the time it could have been given
+	 * wasn't put there by name_cache_put(), so we ignore it. */
+	if (strcmp(slot->addr, ipaddr) == 0 && slot->expires > now
+	 && slot->expires <= now + (strcmp(slot->name, default_name) == 0
+				    ? MIN(lp_name_cache_time(), NAME_CACHE_NEGATIVE_TIME)
+				    : lp_name_cache_time())) {
+		strlcpy(name_buf, slot->name, name_buf_size);
+		found = 1;
+	}
+
+	name_cache_unlock(slot);
+
+	return found;
+}
+
+static void name_cache_put(const char *ipaddr, const char *name)
+{
+	struct name_cache_slot *slot;
+	int cache_time = lp_name_cache_time();
+
+	if (strlen(ipaddr) >= sizeof slot->addr || strlen(name) >= sizeof slot->name
+	 || !(slot = name_cache_lock(ipaddr)))
+		return;
+
+	/* A failed lookup is only remembered briefly. */
+	if (strcmp(name, default_name) == 0 && cache_time > NAME_CACHE_NEGATIVE_TIME)
+		cache_time = NAME_CACHE_NEGATIVE_TIME;
+
+	strlcpy(slot->addr, ipaddr, sizeof slot->addr);
+	strlcpy(slot->name, name, sizeof slot->name);
+	slot->expires = time(NULL) + cache_time;
+
+	name_cache_unlock(slot);
+}
+
+
 /**
  * Return the DNS name of the client.
  *
@@ -100,7 +271,6 @@ char *client_addr(int fd)
 char *client_name(const char *ipaddr)
 {
 	static char name_buf[100];
-	char port_buf[100];
 	struct sockaddr_storage ss;
 	socklen_t ss_len;
 	struct addrinfo hint, *answer;
@@ -143,14 +313,24 @@ char *client_name(const char *ipaddr)
 	}
 	freeaddrinfo(answer);
 
-	/* reverse lookup */
-	err = getnameinfo((struct sockaddr*)&ss, ss_len, name_buf, sizeof name_buf,
-			  port_buf, sizeof port_buf, NI_NAMEREQD | NI_NUMERICSERV);
-	if (err) {
-		strlcpy(name_buf, default_name, sizeof name_buf);
-		rprintf(FLOG, "name lookup failed for %s: %s\n", ipaddr, gai_strerror(err));
-	} else
-		check_name(ipaddr, &ss, name_buf, sizeof name_buf);
+	if (name_cache_get(ipaddr, name_buf, sizeof name_buf)) {
+		if (strcmp(name_buf, default_name) == 0)
+			return name_buf;
+		if (lp_name_lookup_timeout() > 0)
+			lookup_name_with_timeout(ipaddr, &ss, ss_len, name_buf, sizeof name_buf, 1);
+		else
+			lookup_name(ipaddr, &ss, ss_len, name_buf, sizeof name_buf, 1);
+		if (strcmp(name_buf, default_name) != 0)
+			return name_buf;
+		/* The cached name failed the check, so we replace it. */
+	}
+
+	if (lp_name_lookup_timeout() > 0)
+		lookup_name_with_timeout(ipaddr, &ss, ss_len, name_buf, sizeof name_buf, 0);
+	else
+		lookup_name(ipaddr, &ss, ss_len, name_buf, sizeof name_buf, 0);
+
+	name_cache_put(ipaddr, name_buf);
 
 	return name_buf;
 }
@@ -94,6 +94,11 @@ static struct sigaction sigact;
 
 static item_list gid_list = EMPTY_ITEM_LIST;
 
+/* A listening daemon parses its config file just once (see load_config()). */
+static int config_loaded;
+static time_t config_mtime;
+static volatile int got_sighup;
+
 /* Used when "reverse lookup" is off. */
 const char undetermined_hostname[] = "UNDETERMINED";
 
@@ -403,7 +408,7 @@ static int read_arg_from_pipe(int fd, char *buf, int limit)
 }
 #endif
 
-static void set_env_str(const char *var, const char *str)
+void set_env_str(const char *var, const char *str)
 {
 #ifdef HAVE_SETENV
 	if (setenv(var, str, 1) < 0)
@@ -666,7 +671,7 @@ static int rsync_module(int f_in, int f_out, int i, const char *addr, const char
 	char *name = lp_name(i);
 	int use_chroot = lp_use_chroot(i);
 	int ret, pre_exec_arg_fd = -1, pre_exec_error_fd = -1;
-	int save_munge_symlinks;
+	int save_munge_symlinks, waits;
 	pid_t pre_exec_pid = 0;
 	char *request = NULL;
 
@@ -702,9 +707,15 @@ static int rsync_module(int f_in, int f_out, int i, const char *addr, const char
 	if (am_daemon > 0) {
 		rprintf(FLOG, "rsync allowed access on module %s from %s (%s)\n",
 			name, host, addr);
+		checksum_cache_setup(i);
 	}
 
-	if (!claim_connection(lp_lock_file(i), lp_max_connections(i))) {
+	for (waits = 0; !claim_connection(lp_lock_file(i), lp_max_connections(i), lp_private_lock_file(i)); waits++) {
+		/* A full module can make the client wait a bit for a slot. */
+		if (!errno && waits < lp_max_connections_wait(i) * 10) {
+			msleep(100);
+			continue;
+		}
 		if (errno) {
 			rsyserr(FLOG, errno, "failed to open lock file %s",
 				lp_lock_file(i));
@@ -717,11 +728,19 @@ static int rsync_module(int f_in, int f_out, int i, const char *addr, const char
 		}
 		return -1;
 	}
+	if (lp_max_connections(i) > 0) {
+		rprintf(FLOG, "%d of %d connection slots in use on module %s\n",
+			connection_slots_used(i, lp_lock_file(i), 1),
+			lp_max_connections(i), name);
+	}
 
 	read_only = lp_read_only(i); /* may also be overridden by auth_server() */
+	if (am_daemon > 0)
+		trim_secrets_cache(i);
 	auth_user = auth_server(f_in, f_out, i, host, addr, "@RSYNCD: AUTHREQD ");
 
 	if (!auth_user) {
+		metrics_auth_failure(i);
 		io_printf(f_out, "@ERROR: auth failed on module %s\n", name);
 		return -1;
 	}
@@ -729,6 +748,11 @@ static int rsync_module(int f_in, int f_out, int i, const char *addr, const char
 
 	module_id = i;
 
+	if (am_daemon > 0) {
+		bwshare_setup(i, *auth_user ? auth_user : addr);
+		metrics_connection_start(i);
+	}
+
 	if (lp_transfer_logging(module_id) && !logfile_format)
 		logfile_format = lp_log_format(module_id);
 	if (log_format_has(logfile_format, 'i'))
@@ -924,6 +948,11 @@ static int rsync_module(int f_in, int f_out, int i, const char *addr, const char
 		early_input = NULL;
 	}
 
+	if (*lp_flist_cache_dir(i))
+		flist_cache_open_dir(lp_flist_cache_dir(i));
+	if (*lp_compress_cache_dir(i))
+		compress_cache_open_dir(lp_compress_cache_dir(i));
+
 	if (use_chroot) {
 		/*
 		 * XXX: The 'use chroot' flag is a fairly reliable
@@ -1050,6 +1079,9 @@ static int rsync_module(int f_in, int f_out, int i, const char *addr, const char
 	if (namecvt_pid)
 		write_pre_exec_args(namecvt_fd_req, request, orig_early_argv, orig_argv, 2);
 
+	if (*lp_flist_cache_dir(i))
+		flist_cache_note_args(orig_early_argv, orig_argv);
+
 	if (orig_early_argv)
 		free(orig_early_argv);
 
@@ -1230,6 +1262,52 @@ static int load_config(int globals_only)
 	return lp_load(config_file, globals_only);
 }
 
+static void sighup_handler(UNUSED(int val))
+{
+	got_sighup = 1;
+#ifndef HAVE_SIGACTION
+	signal(SIGHUP, sighup_handler);
+#endif
+}
+
+/* A listening daemon parses the config file (and its secrets files) up front
+ * so that each connection's process just inherits the result.  The accept
+ * loop calls this before it hands out a connection: it re-reads the config
+ * when we got a SIGHUP or the file's mtime changed.  If the new file doesn't
+ * parse, we keep using the old settings.  Returns True if anything that was
+ * inherited by idle workers changed. */
+int refresh_daemon_config(void)
+{
+	STRUCT_STAT st;
+
+	if (!config_loaded)
+		return False;
+
+	if (!got_sighup && (do_stat(config_file, &st) < 0 || st.st_mtime == config_mtime))
+		return cache_secrets_files(False);
+	got_sighup = 0;
+	config_mtime = do_stat(config_file, &st) < 0 ? 0 : st.st_mtime;
+
+	if (!lp_reload(config_file)) {
+		rprintf(FLOG, "Failed to re-read config file %s -- keeping the old settings\n",
+			config_file);
+		return False;
+	}
+	if (!lp_num_modules())
+		set_dparams(0);
+	lp_save_raw();
+	cache_secrets_files(True);
+	compile_access_lists();
+	name_cache_init();
+	connection_slots_init();
+	checksum_cache_init();
+	bwshare_init();
+	metrics_init();
+
+	rprintf(FLOG, "re-read config file %s\n", config_file);
+	return True;
+}
+
 /* this is called when a connection is established to a client
    and we want to start talking. The setup of the system is done from
    here */
@@ -1253,7 +1331,12 @@ int start_daemon(int f_in, int f_out)
 	 * might cause log-file output to occur.  This ensures that the
 	 * "log file" param gets honored for the 2 non-forked use-cases
 	 * (when rsync is run by init and run by a remote shell). */
-	if (!load_config(0))
+	if (config_loaded) {
+		/* Restore the normal SIGHUP handling in the connection's process,
+		 * and the settings that the listening daemon didn't expand. */
+		SIGACTION(SIGHUP, sig_int);
+		lp_restore_raw();
+	} else if (!load_config(0))
 		exit_cleanup(RERR_SYNTAX);
 
 	if (lp_proxy_protocol() && !read_proxy_protocol_header(f_in))
@@ -1466,11 +1549,13 @@ int daemon_main(void)
 		return start_daemon(STDIN_FILENO, STDIN_FILENO);
 	}
 
-	if (!load_config(1)) {
+	if (!load_config(0)) {
 		fprintf(stderr, "Failed to parse config file: %s\n", config_file);
 		exit_cleanup(RERR_SYNTAX);
 	}
-	set_dparams(0);
+	if (!lp_num_modules())
+		set_dparams(0);
+	lp_save_raw();
 
 	if (no_detach)
 		create_pid_file();
@@ -1486,6 +1571,21 @@ int daemon_main(void)
 
 	rprintf(FLOG, "rsyncd version %s starting, listening on port %d\n",
 		rsync_version(), rsync_port);
+
+	if (config_file) {
+		STRUCT_STAT st;
+		if (do_stat(config_file, &st) == 0)
+			config_mtime = st.st_mtime;
+	}
+	cache_secrets_files(True);
+	compile_access_lists();
+	name_cache_init();
+	connection_slots_init();
+	checksum_cache_init();
+	bwshare_init();
+	metrics_init();
+	config_loaded = 1;
+	SIGACTION(SIGHUP, sighup_handler);
 	/* TODO: If listening on a particular address, then show that
 	 * address too.  In fact, why not just do getnameinfo on the
 	 * local address??? */
@@ -74,6 +74,7 @@ int use_safe_inc_flist = 0;
 int want_xattr_optim = 0;
 int proper_seed_order = 0;
 int inplace_partial = 0;
+int item_append_ok = 0;
 int do_negotiated_strings = 0;
 int xmit_id0_names = 0;
 
@@ -113,6 +114,7 @@ struct name_num_obj valid_compressions = {
 #define CF_INPLACE_PARTIAL_DIR (1<<6)
 #define CF_VARINT_FLIST_FLAGS (1<<7)
 #define CF_ID0_NAMES (1<<8)
+#define CF_ITEM_APPEND (1<<9)
 
 static const char *client_info;
 
@@ -170,6 +172,8 @@ void set_allow_inc_recurse(void)
 		allow_inc_recurse = 0;
 	else if (am_server && strchr(client_info, 'i') == NULL)
 		allow_inc_recurse = 0;
+	else if (am_server && flist_cache_wanted())
+		allow_inc_recurse = 0; /* Only a full list gets cached. */
 }
 
 void parse_compress_choice(int final_call)
@@ -707,6 +711,8 @@ void setup_protocol(int f_out,int f_in)
 				compat_flags |= CF_INPLACE_PARTIAL_DIR;
 			if (strchr(client_info, 'u') != NULL)
 				compat_flags |= CF_ID0_NAMES;
+			if (strchr(client_info, 'a') != NULL)
+				compat_flags |= CF_ITEM_APPEND;
 			if (strchr(client_info, 'v') != NULL) {
 				do_negotiated_strings = 1;
 				compat_flags |= CF_VARINT_FLIST_FLAGS;
@@ -728,6 +734,7 @@ void setup_protocol(int f_out,int f_in)
 		proper_seed_order = compat_flags & CF_CHKSUM_SEED_FIX ? 1 : 0;
 		xfer_flags_as_varint = compat_flags & CF_VARINT_FLIST_FLAGS ? 1 : 0;
 		xmit_id0_names = compat_flags & CF_ID0_NAMES ? 1 : 0;
+		item_append_ok = compat_flags & CF_ITEM_APPEND ? 1 : 0;
 		if (!xfer_flags_as_varint && preserve_crtimes) {
 			fprintf(stderr, "Both rsync versions must be at least 3.2.0 for --crtimes.\n");
 			exit_cleanup(RERR_PROTOCOL);
@@ -20,23 +20,169 @@
 
 #include "rsync.h"
 
+/* A listening daemon can count the connections of each "private lock file"
+ * in a table that it shares with its connection processes, so that a
+ * connection can claim a slot with an atomic increment instead of trying a
+ * lock on each slot of the lock file.  The daemon adds the lock files of its
+ * modules to the table when it loads its config, and it releases a
+ * connection's slot when it reaps the connection's process.  A lock file
+ * that isn't counted in the table (because some module doesn't make it
+ * private, its name has a %VAR% that each connection expands, or we're an
+ * inetd daemon) still uses record locking, which other daemons can share. */
+#define CONN_LOCK_FILES 64
+#define CONN_RECORDS 4096
+
+struct conn_slots {
+	int file_cnt;
+	struct {
+		char fname[MAXPATHLEN];
+		volatile int used;
+		int counted;
+	} files[CONN_LOCK_FILES];
+	struct {
+		volatile pid_t pid;
+		int file;
+	} recs[CONN_RECORDS];
+};
+
+static struct conn_slots *conn_slots;
+static int lock_fd = -1; /* holds our lock on a lock file's slot */
+
+/* Called by the listening daemon after it (re)loads its config file.  A lock
+ * file stays in the table (with its count) even if no module uses it now. */
+void connection_slots_init(void)
+{
+	int all_private[CONN_LOCK_FILES];
+	int i, f;
+
+	if (!conn_slots) {
+#ifdef SUPPORT_SHARED_TABLES
+		void *map = mmap(NULL, sizeof (struct conn_slots), PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (map == MAP_FAILED) {
+			rsyserr(FLOG, errno, "unable to map the connection slots");
+			return;
+		}
+		conn_slots = map;
+#else
+		return;
+#endif
+	}
+
+	for (f = 0; f < CONN_LOCK_FILES; f++)
+		all_private[f] = -1;
+
+	for (i = 0; i < lp_num_modules(); i++) {
+		char *fname = lp_lock_file(i);
+		if (lp_max_connections(i) <= 0 || !fname || !*fname
+		 || strchr(fname, '%') || strlen(fname) >= MAXPATHLEN)
+			continue;
+		for (f = 0; f < conn_slots->file_cnt; f++) {
+			if (strcmp(conn_slots->files[f].fname, fname) == 0)
+				break;
+		}
+		if (f == conn_slots->file_cnt) {
+			if (f == CONN_LOCK_FILES || !lp_private_lock_file(i))
+				continue;
+			strlcpy(conn_slots->files[f].fname, fname, MAXPATHLEN);
+			memory_barrier();
+			conn_slots->file_cnt++;
+		}
+		all_private[f] = all_private[f] != 0 && lp_private_lock_file(i);
+	}
+
+	for (f = 0; f < conn_slots->file_cnt; f++)
+		conn_slots->files[f].counted = all_private[f] == 1;
+}
+
+static int find_slot_file(const char *fname)
+{
+	int f;
+
+	if (!conn_slots)
+		return -1;
+
+	for (f = 0; f < conn_slots->file_cnt; f++) {
+		if (strcmp(conn_slots->files[f].fname, fname) == 0)
+			return conn_slots->files[f].counted ? f : -1;
+	}
+
+	return -1;
+}
+
+/* Returns 1 if we got a slot, 0 if they are all in use, or -1 if we must
+ * fall back to the lock file. */
+static int claim_slot(int f, int max_connections)
+{
+	volatile int *used = &conn_slots->files[f].used;
+	pid_t pid = getpid();
+	int n, r;
+
+	while (1) {
+		if ((n = *used) >= max_connections)
+			return 0;
+		if (atomic_cas(used, n, n + 1))
+			break;
+	}
+
+	for (r = 0; r < CONN_RECORDS; r++) {
+		if (atomic_cas(&conn_slots->recs[r].pid, 0, pid)) {
+			conn_slots->recs[r].file = f;
+			return 1;
+		}
+	}
+
+	atomic_sub(used, 1);
+	return -1;
+}
+
+/* Called by the listening daemon when it reaps one of its children. */
+void release_connection_slot(pid_t pid)
+{
+	int r;
+
+	if (!conn_slots)
+		return;
+
+	for (r = 0; r < CONN_RECORDS; r++) {
+		if (conn_slots->recs[r].pid == pid) {
+			atomic_sub(&conn_slots->files[conn_slots->recs[r].file].used, 1);
+			memory_barrier();
+			conn_slots->recs[r].pid = 0;
+			break;
+		}
+	}
+}
+
 /* A simple routine to do connection counting.  This returns 1 on success
  * and 0 on failure, with errno also being set if the open() failed (errno
  * will be 0 if the lock request failed). */
-int claim_connection(char *fname, int max_connections)
+int claim_connection(char *fname, int max_connections, int private_file)
 {
 	int fd, i;
 
 	if (max_connections == 0)
 		return 1;
 
+	if (private_file && (i = find_slot_file(fname)) >= 0) {
+		switch (claim_slot(i, max_connections)) {
+		case 1:
+			return 1;
+		case 0:
+			errno = 0;
+			return 0;
+		}
+	}
+
 	if ((fd = open(fname, O_RDWR|O_CREAT, 0600)) < 0)
 		return 0;
 
 	/* Find a free spot. */
 	for (i = 0; i < max_connections; i++) {
-		if (lock_range(fd, i*4, 4))
+		if (lock_range(fd, i*4, 4)) {
+			lock_fd = fd;
 			return 1;
+		}
 	}
 
 	close(fd);
@@ -45,3 +191,43 @@ int claim_connection(char *fname, int max_connections)
 	errno = 0;
 	return 0;
 }
+
+/* Returns how many of the "max connections" slots of module i (whose lock
+ * file is FNAME) are in use, or -1 if there is no limit.  A lock file that
+ * isn't counted in memory is checked for the locks that connections hold,
+ * but a process can't see its own lock, so a connection that has claimed a
+ * slot passes a HOLDING of 1 to count it.  (Such a connection must also
+ * reuse its own descriptor, since closing any descriptor of the file would
+ * drop its lock.) */
+int connection_slots_used(int i, const char *fname, int holding)
+{
+	int max_connections = lp_max_connections(i);
+	int fd, f, used = 0;
+
+	if (max_connections <= 0)
+		return -1;
+
+	if (lp_private_lock_file(i) && (f = find_slot_file(fname)) >= 0)
+		return conn_slots->files[f].used;
+
+	if (holding && lock_fd >= 0)
+		fd = lock_fd;
+	else if ((fd = open(fname, O_RDONLY)) < 0)
+		return holding;
+
+	for (f = 0; f < max_connections; f++) {
+		struct flock lock;
+		lock.l_type = F_WRLCK;
+		lock.l_whence = SEEK_SET;
+		lock.l_start = f * 4;
+		lock.l_len = 4;
+		lock.l_pid = 0;
+		if (fcntl(fd, F_GETLK, &lock) == 0 && lock.l_type != F_UNLCK)
+			used++;
+	}
+
+	if (fd != lock_fd)
+		close(fd);
+
+	return used + holding;
+}
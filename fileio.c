@@ -34,6 +34,7 @@
 #define ALIGNED_LENGTH(len) ((((len) - 1) | (ALIGN_BOUNDARY-1)) + 1)
 
 extern int sparse_files;
+extern int device_image;
 
 OFF_T preallocated_len = 0;
 
@@ -154,7 +155,7 @@ int write_file(int f, int use_seek, OFF_T offset, const char *buf, int len)
 			offset += r1;
 		} else {
 			if (!wf_writeBuf) {
-				wf_writeBufSize = WRITE_SIZE * 8;
+				wf_writeBufSize = device_image ? IMAGE_IO_SIZE : WRITE_SIZE * 8;
 				wf_writeBufCnt  = 0;
 				wf_writeBuf = new_array(char, wf_writeBufSize);
 			}
@@ -224,6 +225,15 @@ struct map_struct *map_file(int fd, OFF_T len, int32 read_size, int32 blk_size)
 	map->file_size = len;
 	map->def_window_size = ALIGNED_LENGTH(read_size);
 
+#if defined HAVE_POSIX_FADVISE && defined POSIX_FADV_SEQUENTIAL
+	/* A file that is bigger than one window will get read front to back
+	 * (the basis file of a delta transfer mostly so), so ask the OS for
+	 * more aggressive read-ahead.  This keeps the disk busy while we are
+	 * hashing or sending the current window of a huge file. */
+	if (len > map->def_window_size)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
 	return map;
 }
 
@@ -326,3 +336,187 @@ int unmap_file(struct map_struct *map)
 
 	return ret;
 }
+
+/* The generator reads every basis file from front to back to make its
+ * checksums, and the receiver then reads the matched blocks of the same file
+ * a second time.  The basis cache is a ring of memory that is shared by the
+ * two (it is mapped before they fork) and into which the generator copies
+ * the basis data that it reads, so that the receiver can take the matched
+ * blocks from there instead of from the disk.
+ *
+ * The generator adds the entries in the order it requests the files, which
+ * is the order the receiver gets them, so when the receiver finds its entry
+ * it drops the entries before it (they were for files it didn't ask about).
+ * A receiver that finds no entry drops nothing, since the entries that are
+ * there may be for the files that follow.  A basis that is too big for the
+ * ring gets an entry that holds just the start of its data (at most half the
+ * ring, so that the next file still has room), and the receiver reads the
+ * rest from the disk.  An entry is identified by its basis file's dev,
+ * inode, size, and mtime. */
+struct basis_cache {
+	volatile int64 head;	/* ring position after the last entry (set by the generator) */
+	volatile int64 tail;	/* ring position of the first entry (set by the receiver) */
+};
+
+struct basis_cache_hdr {
+	int64 next;		/* ring position of the following entry */
+	int64 size;
+	int64 mtime;
+	int64 dev;
+	int64 ino;
+	int64 cached;		/* bytes of data that follow, or -1 for a wrap marker */
+};
+
+#define BASIS_CACHE_HDR_LEN ((int64)sizeof (struct basis_cache_hdr))
+#define BASIS_CACHE_ALIGN(len) (((len) + 7) & ~(int64)7)
+
+static struct basis_cache *basis_cache;
+static char *basis_ring;
+static int64 basis_cache_pending = -1;
+static int64 basis_cache_release = -1;
+
+/* This must be called before the generator and the receiver fork. */
+void basis_cache_init(void)
+{
+#ifdef SUPPORT_SHARED_TABLES
+	void *mem = mmap(NULL, sizeof (struct basis_cache) + BASIS_CACHE_SIZE,
+			 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		if (DEBUG_GTE(DELTASUM, 2))
+			rsyserr(FINFO, errno, "unable to map the basis cache");
+		return;
+	}
+	basis_cache = mem;
+	basis_ring = (char *)(basis_cache + 1);
+#endif
+}
+
+static struct basis_cache_hdr *basis_cache_hdr(int64 pos)
+{
+	return (struct basis_cache_hdr *)(basis_ring + pos % BASIS_CACHE_SIZE);
+}
+
+/* How many bytes we skip before an entry of LEN bytes can start at POS. */
+static int64 basis_cache_skip(int64 pos, int64 len)
+{
+	int64 to_end = BASIS_CACHE_SIZE - pos % BASIS_CACHE_SIZE;
+	return to_end < len ? to_end : 0;
+}
+
+/* The generator calls this before reading the SIZE bytes of the basis file
+ * FD.  The returned buffer (if any) must be filled with the first *LEN_P
+ * bytes of the file's data before basis_cache_commit() is called. */
+char *basis_cache_add(int fd, OFF_T size, OFF_T *len_p)
+{
+	struct basis_cache_hdr *hdr;
+	int64 pos, used, skip, len, data_len;
+	STRUCT_STAT st;
+
+	basis_cache_pending = -1;
+	*len_p = 0;
+	if (!basis_cache || do_fstat(fd, &st) != 0 || st.st_size != size)
+		return NULL;
+
+	pos = basis_cache->head;
+	memory_barrier();
+	used = pos - basis_cache->tail;
+
+	data_len = MIN(size, BASIS_CACHE_SIZE / 2);
+	len = BASIS_CACHE_HDR_LEN + BASIS_CACHE_ALIGN(data_len);
+	skip = basis_cache_skip(pos, len);
+	if (used + skip + len > BASIS_CACHE_SIZE) {
+		/* Cache as much of the data as the free space allows. */
+		int64 to_end = BASIS_CACHE_SIZE - pos % BASIS_CACHE_SIZE;
+		int64 avail = BASIS_CACHE_SIZE - used;
+		if (avail - to_end > to_end) {
+			skip = to_end;
+			avail -= to_end;
+		} else {
+			skip = 0;
+			avail = MIN(avail, to_end);
+		}
+		avail = (avail - BASIS_CACHE_HDR_LEN) & ~(int64)7;
+		if (avail < MIN_BASIS_CACHE_DATA)
+			return NULL;
+		data_len = MIN(data_len, avail);
+		len = BASIS_CACHE_HDR_LEN + data_len;
+	}
+
+	if (skip >= BASIS_CACHE_HDR_LEN) {
+		hdr = basis_cache_hdr(pos);
+		hdr->next = pos + skip;
+		hdr->cached = -1;
+	}
+	pos += skip;
+
+	hdr = basis_cache_hdr(pos);
+	hdr->next = pos + len;
+	hdr->size = size;
+	hdr->mtime = st.st_mtime;
+	hdr->dev = st.st_dev;
+	hdr->ino = st.st_ino;
+	hdr->cached = data_len;
+	basis_cache_pending = hdr->next;
+
+	*len_p = data_len;
+	return (char *)(hdr + 1);
+}
+
+/* Makes the entry from the last basis_cache_add() visible to the receiver. */
+void basis_cache_commit(void)
+{
+	if (basis_cache_pending < 0)
+		return;
+	memory_barrier();
+	basis_cache->head = basis_cache_pending;
+	basis_cache_pending = -1;
+}
+
+/* The receiver calls this to look for the data of the basis file FD.  The
+ * first *LEN_P bytes of the file's data are returned.  Any entries before
+ * the one found are dropped, and the one found is released by
+ * basis_cache_done(). */
+char *basis_cache_find(int fd, OFF_T size, OFF_T *len_p)
+{
+	struct basis_cache_hdr *hdr;
+	int64 pos, head;
+	STRUCT_STAT st;
+
+	*len_p = 0;
+	if (!basis_cache || do_fstat(fd, &st) != 0 || st.st_size != size)
+		return NULL;
+
+	pos = basis_cache->tail;
+	head = basis_cache->head;
+	memory_barrier();
+
+	while (pos < head) {
+		if (basis_cache_skip(pos, BASIS_CACHE_HDR_LEN)) {
+			pos += basis_cache_skip(pos, BASIS_CACHE_HDR_LEN);
+			continue;
+		}
+		hdr = basis_cache_hdr(pos);
+		if (hdr->cached > 0 && hdr->cached <= size && hdr->size == size
+		 && hdr->mtime == (int64)st.st_mtime
+		 && hdr->dev == (int64)st.st_dev && hdr->ino == (int64)st.st_ino) {
+			memory_barrier();
+			basis_cache->tail = pos;
+			basis_cache_release = hdr->next;
+			*len_p = hdr->cached;
+			return (char *)(hdr + 1);
+		}
+		pos = hdr->next;
+	}
+
+	return NULL;
+}
+
+/* Releases the data returned by basis_cache_find(). */
+void basis_cache_done(void)
+{
+	if (basis_cache_release < 0)
+		return;
+	memory_barrier();
+	basis_cache->tail = basis_cache_release;
+	basis_cache_release = -1;
+}
@@ -73,9 +73,12 @@ extern int sender_symlink_iconv;
 extern int output_needs_newline;
 extern int sender_keeps_checksum;
 extern int unsort_ndx;
+extern int compat_flags;
 extern uid_t our_uid;
+extern gid_t our_gid;
 extern struct stats stats;
 extern char *filesfrom_host;
+extern char *files_from;
 extern char *usermap, *groupmap;
 
 extern char curr_dir[MAXPATHLEN];
@@ -2147,6 +2150,467 @@ void send_extra_file_list(int f, int at_least)
 		send_msg_int(MSG_IO_ERROR, io_error);
 }
 
+/* A daemon module with "flist cache dir" set saves the encoded file list
+ * that its sender writes, in a file named after a hash of everything that
+ * can change those bytes: the module, the client's args, the filter rules,
+ * and the negotiated protocol details.  A later sender with the same hash
+ * decodes the saved list, checks that none of its dirs has a new mtime,
+ * and then sends the saved bytes instead of walking the tree again.  An
+ * entry holds a magic string, the data length, the data, the mtime of the
+ * dir that holds the transfer's arg, that dir's path (if any), and an MD5
+ * digest of all that follows the length.  An entry whose digest doesn't
+ * match is removed. */
+
+#define FLIST_CACHE_MAGIC "RSFLC2\n" /* 8 bytes, counting the '\0' */
+#define FLIST_CACHE_HDR_LEN (8 + 8)
+#define FLIST_CACHE_BUF_SIZE (256*1024)
+
+int flist_cache_monitor_in = -1;
+int flist_cache_monitor_out = -1;
+
+static int flist_cache_dirfd = -1;
+static MD5_CTX flist_cache_args;
+#ifdef SUPPORT_FLIST_CACHE
+static int flist_cache_fd = -1;
+static char *flist_cache_buf;
+static size_t flist_cache_pos, flist_cache_len;
+static int64 flist_cache_total;
+static MD5_CTX flist_cache_sum;
+static int flist_cache_failed;
+static time_t flist_cache_start;
+static char flist_cache_tmp[64];
+#endif
+
+/* This is called before any chroot, so the dir need not be inside it. */
+void flist_cache_open_dir(const char *dir)
+{
+#ifdef SUPPORT_FLIST_CACHE
+	if ((flist_cache_dirfd = open(dir, O_RDONLY)) < 0)
+		rsyserr(FLOG, errno, "unable to open flist cache dir %s", dir);
+#else
+	rprintf(FLOG, "flist cache dir %s ignored: not supported on this OS\n", dir);
+#endif
+}
+
+static void md5_strings(MD5_CTX *m5, char **list)
+{
+	for ( ; list && *list; list++)
+		MD5_Update(m5, (uchar *)*list, strlen(*list) + 1);
+	MD5_Update(m5, (uchar *)"", 1);
+}
+
+/* The client's args are hashed as they arrived, before parsing. */
+void flist_cache_note_args(char **early_argv, char **argv)
+{
+	MD5_Init(&flist_cache_args);
+	md5_strings(&flist_cache_args, early_argv);
+	md5_strings(&flist_cache_args, argv);
+}
+
+/* Only a complete (non-incremental) list whose contents depend on nothing
+ * but the module's files and the hashed settings can be reused. */
+int flist_cache_wanted(void)
+{
+	return flist_cache_dirfd >= 0 && am_daemon && am_sender
+	    && protocol_version >= 30 && lp_read_only(module_id)
+	    && !preserve_hard_links && !preserve_acls && !preserve_xattrs
+	    && !relative_paths && !copy_links && !copy_unsafe_links
+	    && !need_unsorted_flist && !files_from && filesfrom_fd < 0;
+}
+
+#ifdef SUPPORT_FLIST_CACHE
+/* The read_buf() hook for the cache entry that is being decoded. */
+void read_flist_cache(char *buf, size_t len)
+{
+	while (len) {
+		size_t siz;
+		if (flist_cache_pos == flist_cache_len) {
+			ssize_t n;
+			do {
+				n = read(flist_cache_monitor_in, flist_cache_buf, FLIST_CACHE_BUF_SIZE);
+			} while (n < 0 && errno == EINTR);
+			if (n <= 0) {
+				rprintf(FERROR, "cached file list is truncated\n");
+				exit_cleanup(RERR_FILEIO);
+			}
+			flist_cache_pos = 0;
+			flist_cache_len = n;
+		}
+		siz = MIN(len, flist_cache_len - flist_cache_pos);
+		memcpy(buf, flist_cache_buf + flist_cache_pos, siz);
+		flist_cache_pos += siz;
+		buf += siz;
+		len -= siz;
+	}
+}
+
+static void flush_flist_cache(void)
+{
+	if (flist_cache_len && !flist_cache_failed
+	 && full_write(flist_cache_fd, flist_cache_buf, flist_cache_len) < 0) {
+		rsyserr(FLOG, errno, "write of flist cache %s failed", flist_cache_tmp);
+		flist_cache_failed = 1;
+	}
+	flist_cache_len = 0;
+}
+
+/* The write_buf() hook that copies the file-list data into a new entry. */
+void write_flist_cache(const char *buf, size_t len)
+{
+	flist_cache_total += len;
+	MD5_Update(&flist_cache_sum, (const uchar *)buf, len);
+	while (len && !flist_cache_failed) {
+		size_t siz = MIN(len, FLIST_CACHE_BUF_SIZE - flist_cache_len);
+		memcpy(flist_cache_buf + flist_cache_len, buf, siz);
+		flist_cache_len += siz;
+		buf += siz;
+		len -= siz;
+		if (flist_cache_len == FLIST_CACHE_BUF_SIZE)
+			flush_flist_cache();
+	}
+}
+
+static void md5_rules(MD5_CTX *m5, filter_rule *ent)
+{
+	for ( ; ent; ent = ent->next) {
+		MD5_Update(m5, (uchar *)ent->pattern, strlen(ent->pattern) + 1);
+		MD5_Update(m5, (uchar *)&ent->rflags, sizeof ent->rflags);
+	}
+	MD5_Update(m5, (uchar *)"", 1);
+}
+
+static int flist_cache_name(char *name, int argc, char *argv[])
+{
+	uchar sum[MD5_DIGEST_LEN];
+	MD5_CTX m5 = flist_cache_args;
+	filter_rule *ent;
+	int32 vals[13];
+	int i;
+
+	/* A per-dir merge file could be edited without changing its dir. */
+	for (ent = filter_list.head; ent; ent = ent->next) {
+		if (ent->rflags & FILTRULE_PERDIR_MERGE)
+			return 0;
+	}
+
+	md5_rules(&m5, filter_list.head);
+	md5_rules(&m5, daemon_filter_list.head);
+
+	MD5_Update(&m5, (uchar *)lp_name(module_id), strlen(lp_name(module_id)) + 1);
+	MD5_Update(&m5, (uchar *)lp_path(module_id), strlen(lp_path(module_id)) + 1);
+	MD5_Update(&m5, (uchar *)lp_outgoing_chmod(module_id), strlen(lp_outgoing_chmod(module_id)) + 1);
+	MD5_Update(&m5, (uchar *)curr_dir, strlen(curr_dir) + 1);
+	for (i = 0; i < argc; i++)
+		MD5_Update(&m5, (uchar *)argv[i], strlen(argv[i]) + 1);
+
+	vals[0] = protocol_version;
+	vals[1] = compat_flags;
+	vals[2] = xfer_flags_as_varint;
+	vals[3] = checksum_type;
+	vals[4] = flist_csum_len;
+	vals[5] = file_extra_cnt;
+	vals[6] = our_uid;
+	vals[7] = our_gid;
+	vals[8] = am_root;
+	vals[9] = munge_symlinks;
+	vals[10] = sanitize_paths;
+	vals[11] = numeric_ids;
+	vals[12] = lp_ignore_nonreadable(module_id);
+	MD5_Update(&m5, (uchar *)vals, sizeof vals);
+
+	MD5_Final(sum, &m5);
+	for (i = 0; i < MD5_DIGEST_LEN; i++)
+		snprintf(name + i*2, 3, "%02x", sum[i]);
+	strlcpy(name + MD5_DIGEST_LEN*2, ".flist", 7);
+
+	return 1;
+}
+
+/* Returns the mtime of the dir that holds the arg, or -1. */
+static int64 arg_dir_mtime(const char *path)
+{
+	char buf[MAXPATHLEN];
+	STRUCT_STAT st;
+
+	if (!path)
+		path = orig_dir;
+	else if (*path != '/') {
+		pathjoin(buf, sizeof buf, orig_dir, path);
+		path = buf;
+	}
+
+	return do_stat(path, &st) < 0 ? -1 : (int64)st.st_mtime;
+}
+
+static void start_flist_cache(int f, const char *name)
+{
+	int64 data_len = 0;
+
+	snprintf(flist_cache_tmp, sizeof flist_cache_tmp, ".%.32s.%d", name, (int)getpid());
+	flist_cache_fd = openat(flist_cache_dirfd, flist_cache_tmp, O_WRONLY|O_CREAT|O_EXCL, 0644);
+	if (flist_cache_fd < 0) {
+		rsyserr(FLOG, errno, "unable to create flist cache %s", flist_cache_tmp);
+		return;
+	}
+
+	if (!flist_cache_buf)
+		flist_cache_buf = new_array(char, FLIST_CACHE_BUF_SIZE);
+	flist_cache_len = 0;
+	flist_cache_failed = 0;
+	flist_cache_start = time(NULL);
+	write_flist_cache(FLIST_CACHE_MAGIC, 8);
+	write_flist_cache((char *)&data_len, sizeof data_len); /* Set at the end. */
+	flist_cache_total = 0;
+	MD5_Init(&flist_cache_sum);
+
+	flist_cache_monitor_out = f;
+}
+
+/* The entry is only saved for an error-free list whose dirs were not
+ * changed so recently that a later change could share their mtime. */
+static void finish_flist_cache(struct file_list *flist, const char *name)
+{
+	const char *path = flist->used ? F_PATHNAME(flist->files[0]) : NULL;
+	int32 path_len = path ? strlen(path) : 0;
+	int64 data_len = flist_cache_total;
+	int64 mtime = arg_dir_mtime(path);
+	int i;
+
+	flist_cache_monitor_out = -1;
+
+	if (io_error || !flist->used || mtime < 0 || mtime >= flist_cache_start - 1)
+		flist_cache_failed = 1;
+	for (i = 0; i < flist->used && !flist_cache_failed; i++) {
+		struct file_struct *file = flist->files[i];
+		if (F_PATHNAME(file) != path
+		 || (S_ISDIR(file->mode) && file->modtime >= flist_cache_start - 1))
+			flist_cache_failed = 1;
+	}
+
+	if (!flist_cache_failed) {
+		uchar sum[MD5_DIGEST_LEN];
+		write_flist_cache((char *)&mtime, sizeof mtime);
+		write_flist_cache((char *)&path_len, sizeof path_len);
+		write_flist_cache(path, path_len);
+		MD5_Final(sum, &flist_cache_sum);
+		write_flist_cache((char *)sum, sizeof sum);
+		flush_flist_cache();
+	}
+	if (!flist_cache_failed
+	 && (do_lseek(flist_cache_fd, 8, SEEK_SET) != 8
+	  || full_write(flist_cache_fd, (char *)&data_len, sizeof data_len) < 0)) {
+		rsyserr(FLOG, errno, "write of flist cache %s failed", flist_cache_tmp);
+		flist_cache_failed = 1;
+	}
+	if (close(flist_cache_fd) < 0)
+		flist_cache_failed = 1;
+	flist_cache_fd = -1;
+
+	if (!flist_cache_failed
+	 && renameat(flist_cache_dirfd, flist_cache_tmp, flist_cache_dirfd, name) < 0) {
+		rsyserr(FLOG, errno, "rename of flist cache %s failed", flist_cache_tmp);
+		flist_cache_failed = 1;
+	}
+	if (flist_cache_failed)
+		unlinkat(flist_cache_dirfd, flist_cache_tmp, 0);
+}
+
+/* Reads the rest of the entry after its length, checking its digest. */
+static int read_flist_cache_trailer(int fd, int64 data_len, int64 *mtime_p, char **path_p)
+{
+	uchar sum[MD5_DIGEST_LEN], saved_sum[MD5_DIGEST_LEN];
+	MD5_CTX m5;
+	int32 path_len;
+
+	if (!flist_cache_buf)
+		flist_cache_buf = new_array(char, FLIST_CACHE_BUF_SIZE);
+
+	MD5_Init(&m5);
+	while (data_len > 0) {
+		size_t siz = MIN(data_len, FLIST_CACHE_BUF_SIZE);
+		if (!full_read(fd, flist_cache_buf, siz))
+			return 0;
+		MD5_Update(&m5, (uchar *)flist_cache_buf, siz);
+		data_len -= siz;
+	}
+
+	if (!full_read(fd, (char *)mtime_p, sizeof *mtime_p)
+	 || !full_read(fd, (char *)&path_len, sizeof path_len)
+	 || path_len < 0 || path_len >= MAXPATHLEN)
+		return 0;
+	MD5_Update(&m5, (uchar *)mtime_p, sizeof *mtime_p);
+	MD5_Update(&m5, (uchar *)&path_len, sizeof path_len);
+	if (path_len) {
+		*path_p = new_array(char, path_len + 1);
+		if (!full_read(fd, *path_p, path_len))
+			return 0;
+		(*path_p)[path_len] = '\0';
+		MD5_Update(&m5, (uchar *)*path_p, path_len);
+	}
+
+	MD5_Final(sum, &m5);
+	return full_read(fd, (char *)saved_sum, sizeof saved_sum)
+	    && memcmp(sum, saved_sum, sizeof sum) == 0;
+}
+
+/* Returns the file list from a valid cache entry after sending its data,
+ * or NULL (having changed nothing that matters) if a walk is needed. */
+static struct file_list *send_cached_file_list(int f, const char *name)
+{
+	struct file_list *flist;
+	struct stats save_stats = stats;
+	struct chmod_mode_struct *save_chmod_modes = chmod_modes;
+	struct timeval start_tv, end_tv;
+	int save_io_error = io_error, save_depth_ndx = depth_ndx;
+	int64 data_len, mtime, start_write;
+	char magic[8], *path = NULL;
+	int32 path_len;
+	int fd, i, disable_buffering;
+	STRUCT_STAT fst;
+
+	if ((fd = openat(flist_cache_dirfd, name, O_RDONLY)) < 0)
+		return NULL;
+
+	gettimeofday(&start_tv, NULL);
+
+	if (!orig_dir)
+		orig_dir = strdup(curr_dir);
+
+	if (do_fstat(fd, &fst) < 0 || !full_read(fd, magic, sizeof magic)
+	 || memcmp(magic, FLIST_CACHE_MAGIC, sizeof magic) != 0
+	 || !full_read(fd, (char *)&data_len, sizeof data_len)
+	 || data_len <= 0 || data_len > (int64)fst.st_size
+	 || !read_flist_cache_trailer(fd, data_len, &mtime, &path)) {
+		rprintf(FLOG, "removing invalid flist cache %s\n", name);
+		unlinkat(flist_cache_dirfd, name, 0);
+		goto stale;
+	}
+	path_len = path ? strlen(path) : 0;
+	if (arg_dir_mtime(path) != mtime
+	 || !change_pathname(NULL, path, path ? -path_len : 0)
+	 || do_lseek(fd, FLIST_CACHE_HDR_LEN, SEEK_SET) != FLIST_CACHE_HDR_LEN)
+		goto stale;
+
+	if (!flist_cache_buf)
+		flist_cache_buf = new_array(char, FLIST_CACHE_BUF_SIZE);
+	flist_cache_pos = flist_cache_len = 0;
+	flist_cache_monitor_in = fd;
+
+	flist = cur_flist = flist_new(0, "send_cached_file_list");
+	dir_flist = cur_flist;
+
+	/* The sender has no depth slot, so let recv_file_entry() put it in
+	 * the pathname slot that we set below.  The saved modes have already
+	 * been tweaked by any --chmod. */
+	depth_ndx = pathname_ndx;
+	chmod_modes = NULL;
+
+	while (1) {
+		struct file_struct *file;
+		int xflags;
+
+		if (xfer_flags_as_varint) {
+			if ((xflags = read_varint(fd)) == 0) {
+				read_varint(fd);
+				break;
+			}
+		} else {
+			if ((xflags = read_byte(fd)) == 0)
+				break;
+			if (xflags & XMIT_EXTENDED_FLAGS)
+				xflags |= read_byte(fd) << 8;
+		}
+
+		flist_expand(flist, 1);
+		file = recv_file_entry(fd, flist, xflags);
+		F_PATHNAME(file) = pathname;
+
+		if (S_ISDIR(file->mode))
+			stats.num_dirs++;
+		else if (S_ISLNK(file->mode))
+			stats.num_symlinks++;
+		else if (IS_DEVICE(file->mode))
+			stats.num_devices++;
+		else if (IS_SPECIAL(file->mode))
+			stats.num_specials++;
+
+		flist->files[flist->used++] = file;
+	}
+
+	depth_ndx = save_depth_ndx;
+	chmod_modes = save_chmod_modes;
+	flist_cache_monitor_in = -1;
+
+	for (i = 0; i < flist->used; i++) {
+		struct file_struct *file = flist->files[i];
+		STRUCT_STAT st;
+		if (!S_ISDIR(file->mode))
+			continue;
+		if (link_stat(f_name(file, NULL), &st, copy_dirlinks) < 0
+		 || !S_ISDIR(st.st_mode) || st.st_mtime != file->modtime) {
+			flist_free(flist);
+			goto stale;
+		}
+	}
+
+	rprintf(FLOG, "sending cached file list\n");
+
+	flist->sorted = flist->files;
+	flist_sort_and_clean(flist, 0);
+	file_total += flist->used;
+	file_old_total += flist->used;
+
+	gettimeofday(&end_tv, NULL);
+	stats.flist_buildtime = (int64)(end_tv.tv_sec - start_tv.tv_sec) * 1000
+			      + (end_tv.tv_usec - start_tv.tv_usec) / 1000;
+	if (stats.flist_buildtime == 0)
+		stats.flist_buildtime = 1;
+	start_tv = end_tv;
+
+	start_write = stats.total_written;
+	disable_buffering = io_start_buffering_out(f);
+	if (do_lseek(fd, FLIST_CACHE_HDR_LEN, SEEK_SET) != FLIST_CACHE_HDR_LEN) {
+		rsyserr(FERROR, errno, "lseek of flist cache %s failed", name);
+		exit_cleanup(RERR_FILEIO);
+	}
+	while (data_len > 0) {
+		size_t siz = MIN(data_len, FLIST_CACHE_BUF_SIZE);
+		if (!full_read(fd, flist_cache_buf, siz)) {
+			rsyserr(FERROR, errno, "read of flist cache %s failed", name);
+			exit_cleanup(RERR_FILEIO);
+		}
+		write_buf(f, flist_cache_buf, siz);
+		data_len -= siz;
+	}
+	if (disable_buffering)
+		io_end_buffering_out(IOBUF_FREE_BUFS);
+	close(fd);
+	if (path)
+		free(path);
+
+	gettimeofday(&end_tv, NULL);
+	stats.flist_xfertime = (int64)(end_tv.tv_sec - start_tv.tv_sec) * 1000
+			     + (end_tv.tv_usec - start_tv.tv_usec) / 1000;
+	stats.flist_size = stats.total_written - start_write;
+	stats.num_files = flist->used;
+
+	if (DEBUG_GTE(FLIST, 3))
+		output_flist(flist);
+
+	flist_eof = 1;
+
+	return flist;
+
+  stale:
+	close(fd);
+	if (path)
+		free(path);
+	stats = save_stats;
+	io_error = save_io_error;
+	return NULL;
+}
+#endif
+
 struct file_list *send_file_list(int f, int argc, char *argv[])
 {
 	static const char *lastdir;
@@ -2167,6 +2631,16 @@ struct file_list *send_file_list(int f, int argc, char *argv[])
 #endif
 		     | (eol_nulls || reading_remotely ? RL_EOL_NULLS : 0);
 	int implied_dot_dir = 0;
+#ifdef SUPPORT_FLIST_CACHE
+	char cache_name[MD5_DIGEST_LEN*2 + 7];
+	int use_cache = 0;
+
+	if (argc == 1 && flist_cache_wanted() && flist_cache_name(cache_name, argc, argv)) {
+		if ((flist = send_cached_file_list(f, cache_name)) != NULL)
+			return flist;
+		use_cache = 1;
+	}
+#endif
 
 	rprintf(FLOG, "building file list\n");
 	if (show_filelist_progress)
@@ -2192,6 +2666,11 @@ struct file_list *send_file_list(int f, int argc, char *argv[])
 	} else
 		dir_flist = cur_flist;
 
+#ifdef SUPPORT_FLIST_CACHE
+	if (use_cache)
+		start_flist_cache(f, cache_name);
+#endif
+
 	disable_buffering = io_start_buffering_out(f);
 	if (filesfrom_fd >= 0) {
 		if (argv[0] && !change_dir(argv[0], CD_NORMAL)) {
@@ -2475,6 +2954,11 @@ struct file_list *send_file_list(int f, int argc, char *argv[])
 	else if (!use_safe_inc_flist && io_error && !ignore_errors)
 		send_msg_int(MSG_IO_ERROR, io_error);
 
+#ifdef SUPPORT_FLIST_CACHE
+	if (flist_cache_monitor_out >= 0)
+		finish_flist_cache(flist, cache_name);
+#endif
+
 	if (disable_buffering)
 		io_end_buffering_out(IOBUF_FREE_BUFS);
 
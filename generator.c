@@ -22,6 +22,7 @@
 
 #include "rsync.h"
 #include "inums.h"
+#include "itypes.h"
 #include "ifuncs.h"
 
 extern int dry_run;
@@ -40,11 +41,21 @@ extern int preserve_xattrs;
 extern int preserve_links;
 extern int preserve_devices;
 extern int write_devices;
+extern int device_image;
 extern int preserve_specials;
 extern int preserve_hard_links;
 extern int preserve_executability;
 extern int preserve_perms;
 extern int preserve_times;
+extern int preserve_atimes;
+extern int preserve_crtimes;
+extern int preserve_uid;
+extern int preserve_gid;
+extern int numeric_ids;
+extern int copy_links;
+extern int copy_unsafe_links;
+extern int munge_symlinks;
+extern int sparse_files;
 extern int delete_mode;
 extern int delete_before;
 extern int delete_during;
@@ -61,14 +72,19 @@ extern int ignore_non_existing;
 extern int want_xattr_optim;
 extern int modify_window;
 extern int inplace;
+extern int keep_partial;
 extern int append_mode;
+extern int append_guess;
+extern int item_append_ok;
 extern int make_backups;
 extern int csum_length;
 extern int ignore_times;
 extern int size_only;
 extern OFF_T max_size;
+extern OFF_T interleave_size;
 extern OFF_T min_size;
 extern int io_error;
+extern int got_xfer_error;
 extern int flist_eof;
 extern int allowed_lull;
 extern int sock_f_out;
@@ -78,6 +94,13 @@ extern int fuzzy_basis;
 extern int always_checksum;
 extern int flist_csum_len;
 extern char *partial_dir;
+extern char curr_dir[MAXPATHLEN];
+extern char *backup_dir;
+extern char *backup_suffix;
+extern char *usermap;
+extern char *groupmap;
+extern char *checkpoint_path;
+extern char *delta_history_path;
 extern int alt_dest_type;
 extern int whole_file;
 extern int list_only;
@@ -753,17 +776,286 @@ static void sum_sizes_sqroot(struct sum_struct *sum, int64 len)
 }
 
 
+/* When a remote transfer was given neither --whole-file nor --no-whole-file,
+ * each file with a basis gets a runtime choice: the delta algorithm can at
+ * best save the time the file's data takes to arrive, but it costs at least
+ * one read+checksum of the basis, so it loses once the link outruns that.
+ * The receiver reports the rate of its mostly-literal files (MSG_XFER_RATE)
+ * and we time our own checksum generation (excluding any output stalls).
+ * Both totals are halved as they pass AUTO_WHOLE_WINDOW so that the choice
+ * follows the current rates. */
+static int auto_whole_file;
+static int64 xfer_rate_bytes, xfer_rate_usec;
+static int64 sum_rate_bytes, sum_rate_usec;
+static int auto_delta_files, auto_whole_files;
+
+static int64 usec_since(struct timeval *start_tv)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return (int64)(now.tv_sec - start_tv->tv_sec) * 1000000
+	     + (now.tv_usec - start_tv->tv_usec);
+}
+
+static void add_rate_sample(int64 *bytes_p, int64 *usec_p, int64 bytes, int64 usec)
+{
+	if (bytes <= 0 || usec <= 0)
+		return;
+	*bytes_p += bytes;
+	*usec_p += usec;
+	if (*bytes_p > AUTO_WHOLE_WINDOW) {
+		*bytes_p /= 2;
+		*usec_p /= 2;
+	}
+}
+
+void note_xfer_rate(int64 bytes, int64 usec)
+{
+	if (auto_whole_file)
+		add_rate_sample(&xfer_rate_bytes, &xfer_rate_usec, bytes, usec);
+}
+
+/* Returns the rate in bytes/sec, or 0 if there isn't enough data yet. */
+static int64 sample_rate(int64 bytes, int64 usec)
+{
+	if (bytes < MIN_AUTO_WHOLE_BYTES || usec <= 0)
+		return 0;
+
+	return (int64)((double)bytes * 1000000 / usec);
+}
+
+static int auto_sends_whole(void)
+{
+	int64 xfer_rate = sample_rate(xfer_rate_bytes, xfer_rate_usec);
+	int64 sum_rate = sample_rate(sum_rate_bytes, sum_rate_usec);
+	int send_whole = xfer_rate && sum_rate && xfer_rate > sum_rate;
+
+	if (send_whole)
+		auto_whole_files++;
+	else
+		auto_delta_files++;
+
+	return send_whole;
+}
+
+/* Explains the choices made by auto_sends_whole() for --stats.  The receiver
+ * does the summary output, so we send this before the transfer is over. */
+static void output_auto_whole_stats(void)
+{
+	int64 xfer_rate = sample_rate(xfer_rate_bytes, xfer_rate_usec);
+	int64 sum_rate = sample_rate(sum_rate_bytes, sum_rate_usec);
+
+	rprintf(FINFO, "Delta-transfer choices: %s delta, %s whole-file\n",
+		comma_num(auto_delta_files), comma_num(auto_whole_files));
+	if (xfer_rate && sum_rate) {
+		rprintf(FINFO, "File-data rate %s bytes/sec %s checksum rate %s bytes/sec\n",
+			human_num(xfer_rate), xfer_rate > sum_rate ? "exceeds" : "is below",
+			human_num(sum_rate));
+	} else
+		rprintf(FINFO, "Not enough data to compare file-data and checksum rates\n");
+}
+
+/* The --delta-history file remembers (as "MISSES SEEN NAME" lines) the files
+ * for which the delta-transfer algorithm recently matched little of the data.
+ * After DELTA_HISTORY_MISSES such runs a file is sent whole without any
+ * checksums, except that every DELTA_HISTORY_PROBE runs we try a delta again
+ * in case the file's nature has changed.  SEEN is when a run last came across
+ * the file, so that an entry is dropped once its file is gone or it hasn't
+ * been part of a transfer for DELTA_HISTORY_MAX_AGE seconds.  The first line
+ * names the destination dir that the names are relative to; the entries of
+ * a file written for another destination are ignored (and dropped). */
+#define DELTA_HISTORY_MAGIC "#rsync-delta-history 1 "
+#define DELTA_HISTORY_MISSES 2
+#define DELTA_HISTORY_PROBE 8
+#define DELTA_HISTORY_MAX_AGE (30*24*60*60)
+
+struct delta_hist {
+	struct delta_hist *next;
+	char *fname;
+	time_t seen; /* when a run last came across the file */
+	int misses; /* runs since a delta last paid off */
+	int found; /* this run came across the file */
+};
+
+static struct hashtable *delta_hist_tbl;
+static struct delta_hist *delta_hist_list;
+static time_t delta_hist_start;
+static char *delta_hist_header;
+
+static int64 delta_hist_key(const char *fname)
+{
+	uchar sum[MD5_DIGEST_LEN];
+	int64 key = 0;
+	MD5_CTX m5;
+
+	MD5_Init(&m5);
+	MD5_Update(&m5, (uchar *)fname, strlen(fname));
+	MD5_Final(sum, &m5);
+	memcpy(&key, sum, sizeof key);
+
+	return key ? key : 1; /* hashtable_find() doesn't like a 0 key. */
+}
+
+static struct delta_hist *find_delta_hist(const char *fname, int create)
+{
+	struct ht_int64_node *node;
+	struct delta_hist *dh;
+
+	node = hashtable_find(delta_hist_tbl, delta_hist_key(fname), create ? (void*)-1L : NULL);
+	if (!node)
+		return NULL;
+	if (node->data != (void*)-1L)
+		return node->data;
+
+	dh = new(struct delta_hist);
+	dh->fname = strdup(fname);
+	dh->seen = delta_hist_start;
+	dh->misses = 0;
+	dh->found = 0;
+	dh->next = delta_hist_list;
+	delta_hist_list = node->data = dh;
+
+	return dh;
+}
+
+static void load_delta_history(void)
+{
+	char line[MAXPATHLEN + 32], *cp;
+	FILE *fp;
+
+	delta_hist_tbl = hashtable_create(1024, HT_KEY64);
+	delta_hist_start = time(NULL);
+	if (asprintf(&delta_hist_header, "%s%s\n", DELTA_HISTORY_MAGIC, curr_dir) < 0)
+		out_of_memory("load_delta_history");
+
+	if (!(fp = fopen(delta_history_path, "r")))
+		return;
+	if (fgets(line, sizeof line, fp) && strcmp(line, delta_hist_header) != 0) {
+		rprintf(FWARNING,
+			"delta history %s is for another destination -- starting it afresh\n",
+			delta_history_path);
+		fclose(fp);
+		return;
+	}
+	while (fgets(line, sizeof line, fp)) {
+		int misses = strtol(line, &cp, 10);
+		struct delta_hist *dh;
+		char *name;
+		time_t seen;
+		int len;
+		if (cp == line || *cp++ != ' ' || misses <= 0)
+			continue;
+		seen = (time_t)strtoll(cp, &name, 10);
+		if (name == cp || *name++ != ' ')
+			continue;
+		if ((len = strlen(name)) == 0 || name[len-1] != '\n')
+			continue; /* Ignore a torn or over-long line. */
+		name[len-1] = '\0';
+		dh = find_delta_hist(name, 1);
+		dh->misses = misses;
+		dh->seen = seen;
+	}
+	fclose(fp);
+}
+
+static void save_delta_history(void)
+{
+	char tmpname[MAXPATHLEN];
+	struct delta_hist *dh;
+	FILE *fp;
+
+	if (snprintf(tmpname, sizeof tmpname, "%s.tmp", delta_history_path) >= (int)sizeof tmpname
+	 || !(fp = fopen(tmpname, "w"))) {
+		rsyserr(FERROR, errno, "failed to write delta history %s", delta_history_path);
+		return;
+	}
+	fputs(delta_hist_header, fp);
+	for (dh = delta_hist_list; dh; dh = dh->next) {
+		STRUCT_STAT st;
+		if (dh->misses <= 0)
+			continue;
+		/* An entry this run didn't come across is kept only while its
+		 * file exists and it isn't too old. */
+		if (!dh->found
+		 && (delta_hist_start - dh->seen > DELTA_HISTORY_MAX_AGE
+		  || (do_lstat(dh->fname, &st) < 0 && errno == ENOENT)))
+			continue;
+		fprintf(fp, "%d %s %s\n", dh->misses, big_num(dh->seen), dh->fname);
+	}
+	if (fclose(fp) != 0 || do_rename(tmpname, delta_history_path) < 0) {
+		rsyserr(FERROR, errno, "failed to write delta history %s", delta_history_path);
+		do_unlink(tmpname);
+	}
+}
+
+/* Notes that this run came across a regular file, and forgets the history of
+ * one that no longer exists on the receiving side. */
+static void delta_history_seen(const char *fname, int exists)
+{
+	struct delta_hist *dh = find_delta_hist(fname, 0);
+
+	if (!dh)
+		return;
+	if (exists) {
+		dh->seen = delta_hist_start;
+		dh->found = 1;
+	} else
+		dh->misses = 0;
+}
+
+/* Returns 1 if the file's history says to skip the checksums this time. */
+static int delta_history_says_whole(const char *fname)
+{
+	struct delta_hist *dh = find_delta_hist(fname, 0);
+
+	if (!dh || dh->misses < DELTA_HISTORY_MISSES || dh->misses % DELTA_HISTORY_PROBE == 0)
+		return 0;
+
+	dh->misses++;
+
+	return 1;
+}
+
+void note_delta_result(int ndx, int64 literal, int64 matched)
+{
+	struct file_list *flist;
+	struct file_struct *file;
+	struct delta_hist *dh;
+	char fbuf[MAXPATHLEN];
+	const char *fname;
+
+	if (!delta_hist_tbl)
+		return;
+
+	flist = flist_for_ndx(ndx, "note_delta_result");
+	file = flist->files[ndx - flist->ndx_start];
+	if (F_LENGTH(file) < MIN_DELTA_HISTORY_SIZE)
+		return;
+	fname = solo_file ? solo_file : f_name(file, fbuf);
+
+	if (matched <= literal / 8) {
+		dh = find_delta_hist(fname, 1);
+		dh->misses++;
+		dh->found = 1;
+	} else if ((dh = find_delta_hist(fname, 0)) != NULL)
+		dh->misses = 0;
+}
+
 /*
  * Generate and send a stream of signatures/checksums that describe a buffer
  *
  * Generate approximately one checksum every block_len bytes.
  */
-static int generate_and_send_sums(int fd, OFF_T len, int f_out, int f_copy)
+static int generate_and_send_sums(int fd, OFF_T len, int f_out, int f_copy,
+				  char *cache, OFF_T cache_len)
 {
 	int32 i;
 	struct map_struct *mapbuf;
 	struct sum_struct sum;
 	OFF_T offset = 0;
+	int64 sum_usec = 0;
 
 	sum_sizes_sqroot(&sum, len);
 	if (sum.count < 0)
@@ -774,15 +1066,21 @@ static int generate_and_send_sums(int fd, OFF_T len, int f_out, int f_copy)
 		return 0;
 
 	if (len > 0)
-		mapbuf = map_file(fd, len, MAX_MAP_SIZE, sum.blength);
+		mapbuf = map_file(fd, len, device_image ? IMAGE_IO_SIZE : MAX_MAP_SIZE, sum.blength);
 	else
 		mapbuf = NULL;
 
 	for (i = 0; i < sum.count; i++) {
 		int32 n1 = (int32)MIN(len, (OFF_T)sum.blength);
-		char *map = map_ptr(mapbuf, offset, n1);
+		struct timeval start_tv;
 		char sum2[SUM_LENGTH];
 		uint32 sum1;
+		char *map;
+
+		if (auto_whole_file)
+			gettimeofday(&start_tv, NULL);
+
+		map = map_ptr(mapbuf, offset, n1);
 
 		len -= n1;
 		offset += n1;
@@ -796,6 +1094,15 @@ static int generate_and_send_sums(int fd, OFF_T len, int f_out, int f_copy)
 		sum1 = get_checksum1(map, n1);
 		get_checksum2(map, n1, sum2);
 
+		if (auto_whole_file)
+			sum_usec += usec_since(&start_tv);
+
+		if (offset - n1 < cache_len)
+			memcpy(cache + offset - n1, map, MIN(n1, cache_len - (offset - n1)));
+		/* The receiver can't get the file before it has all the sums. */
+		if (i == sum.count - 1)
+			basis_cache_commit();
+
 		if (DEBUG_GTE(DELTASUM, 3)) {
 			rprintf(FINFO,
 				"chunk[%s] offset=%s len=%ld sum1=%08lx\n",
@@ -806,6 +1113,9 @@ static int generate_and_send_sums(int fd, OFF_T len, int f_out, int f_copy)
 		write_buf(f_out, sum2, sum.s2length);
 	}
 
+	if (auto_whole_file)
+		add_rate_sample(&sum_rate_bytes, &sum_rate_usec, offset, sum_usec);
+
 	if (mapbuf)
 		unmap_file(mapbuf);
 
@@ -813,12 +1123,15 @@ static int generate_and_send_sums(int fd, OFF_T len, int f_out, int f_copy)
 }
 
 
-/* Try to find a filename in the same dir as "fname" with a similar name. */
+/* Try to find a filename in the same dir as "fname" with a similar name.
+ * Only one basis is chosen: matching against several at once would need a
+ * basis index in each matched token (and a compat flag to negotiate it). */
 static struct file_struct *find_fuzzy(struct file_struct *file, struct file_list *dirlist_array[], uchar *fnamecmp_type_ptr)
 {
 	int fname_len, fname_suf_len;
 	const char *fname_suf, *fname = file->basename;
 	uint32 lowest_dist = 25 << 16; /* ignore a distance greater than 25 */
+	OFF_T lowest_size_diff = 0;
 	int i, j;
 	struct file_struct *lowest_fp = NULL;
 
@@ -862,6 +1175,7 @@ static struct file_struct *find_fuzzy(struct file_struct *file, struct file_list
 			const char *suf, *name;
 			int len, suf_len;
 			uint32 dist;
+			OFF_T size_diff;
 
 			if (!F_IS_ACTIVE(fp))
 				continue;
@@ -880,8 +1194,19 @@ static struct file_struct *find_fuzzy(struct file_struct *file, struct file_list
 				rprintf(FINFO, "fuzzy distance for %s = %d.%05d\n",
 					f_name(fp, NULL), (int)(dist>>16), (int)(dist&0xFFFF));
 			}
-			if (dist <= lowest_dist) {
+			/* When several candidates need the same number of edits
+			 * (e.g. foo-1.2.tar & foo-1.3.tar for foo-1.4.tar), pick
+			 * the one whose size is closest to the new file, since it
+			 * is the most likely to share the bulk of its data. */
+			size_diff = F_LENGTH(fp) - F_LENGTH(file);
+			if (size_diff < 0)
+				size_diff = -size_diff;
+			if (dist > lowest_dist && (!lowest_fp || dist >> 16 != lowest_dist >> 16))
+				continue;
+			if (!lowest_fp || dist >> 16 < lowest_dist >> 16 || size_diff < lowest_size_diff
+			 || (size_diff == lowest_size_diff && dist <= lowest_dist)) {
 				lowest_dist = dist;
+				lowest_size_diff = size_diff;
 				lowest_fp = fp;
 				*fnamecmp_type_ptr = FNAMECMP_FUZZY + i;
 			}
@@ -928,6 +1253,91 @@ static int copy_altdest_file(const char *src, const char *dest, struct file_stru
 	return ok ? 0 : -1;
 }
 
+/* When --checksum is in effect, we remember the destination files that we
+ * have verified to hold the same data as their sender-side checksum (either
+ * because they were up-to-date or because we copied them locally).  A new
+ * file that has identical content can then be copied from one of these
+ * instead of being sent over the wire.  This is not done when reading or
+ * writing a batch, since the batch file must hold the data for every file
+ * that the batch's receiver will need to update. */
+struct session_file {
+	char *fname;
+	OFF_T len;
+	char sum[MAX_DIGEST_LEN];
+};
+
+static struct hashtable *session_files;
+
+static int64 session_file_key(struct file_struct *file)
+{
+	int64 key = 0;
+
+	memcpy(&key, F_SUM(file), MIN(flist_csum_len, (int)sizeof key));
+	key ^= F_LENGTH(file);
+
+	return key ? key : 1; /* hashtable_find() doesn't like a 0 key. */
+}
+
+static void remember_session_file(struct file_struct *file, const char *fname)
+{
+	struct ht_int64_node *node;
+	struct session_file *sf;
+
+	if (always_checksum <= 0 || read_batch || write_batch
+	 || F_LENGTH(file) < MIN_SESSION_COPY_SIZE)
+		return;
+
+	if (!session_files)
+		session_files = hashtable_create(1024, HT_KEY64);
+
+	node = hashtable_find(session_files, session_file_key(file), (void*)-1L);
+	if (node->data != (void*)-1L)
+		return; /* We already know of a file with this data. */
+
+	sf = new(struct session_file);
+	sf->fname = strdup(fname);
+	sf->len = F_LENGTH(file);
+	memcpy(sf->sum, F_SUM(file), flist_csum_len);
+	node->data = sf;
+}
+
+/* Returns 1 if we found an earlier file in this session with the same data
+ * and copied it into place, else 0. */
+static int try_session_copy(struct file_struct *file, char *fname, int ndx,
+			    char *cmpbuf, stat_x *sxp, int itemizing)
+{
+	struct ht_int64_node *node;
+	struct session_file *sf;
+
+	if (!session_files
+	 || !(node = hashtable_find(session_files, session_file_key(file), NULL)))
+		return 0;
+
+	sf = node->data;
+	if (sf->len != F_LENGTH(file) || memcmp(sf->sum, F_SUM(file), flist_csum_len) != 0)
+		return 0;
+
+	strlcpy(cmpbuf, sf->fname, MAXPATHLEN);
+	if (link_stat(cmpbuf, &sxp->st, 0) < 0 || !S_ISREG(sxp->st.st_mode)
+	 || sxp->st.st_size != sf->len)
+		return 0;
+
+	if (DEBUG_GTE(GENR, 1))
+		rprintf(FINFO, "copying %s from identical file %s\n", fname, cmpbuf);
+
+	if (!dry_run && copy_altdest_file(cmpbuf, fname, file) < 0)
+		return 0;
+
+	if (itemizing)
+		itemize(cmpbuf, file, ndx, -1, sxp, ITEM_LOCAL_CHANGE, 0, NULL);
+	else if (maybe_ATTRS_REPORT && INFO_GTE(NAME, 1))
+		rprintf(FINFO, "%s\n", fname);
+
+	remember_session_file(file, fname);
+
+	return 1;
+}
+
 /* This is only called for regular files.  We return -2 if we've finished
  * handling the file, -1 if no dest-linking occurred, or a non-negative
  * value if we found an alternate basis file.  If we're called with the
@@ -1212,7 +1622,7 @@ static void recv_generator(char *fname, struct file_struct *file, int ndx,
 	static struct file_list *fuzzy_dirlist[MAX_BASIS_DIRS+1];
 	static int need_fuzzy_dirlist = 0;
 	struct file_struct *fuzzy_file = NULL;
-	int fd = -1, f_copy = -1;
+	int fd = -1, f_copy = -1, append_item = 0, send_whole = 0;
 	stat_x sx, real_sx;
 	STRUCT_STAT partial_st;
 	struct file_struct *back_file = NULL;
@@ -1719,6 +2129,9 @@ static void recv_generator(char *fname, struct file_struct *file, int ndx,
 		stat_errno = ENOENT;
 	}
 
+	if (delta_hist_tbl)
+		delta_history_seen(fname, statret == 0);
+
 	if (basis_dir[0] != NULL && (statret != 0 || alt_dest_type != COPY_DEST)) {
 		int j = try_dests_reg(file, fname, ndx, fnamecmpbuf, &sx, statret == 0, itemizing, code);
 		if (j == -2) {
@@ -1733,6 +2146,16 @@ static void recv_generator(char *fname, struct file_struct *file, int ndx,
 		}
 	}
 
+	if (statret != 0 && always_checksum > 0 && !read_batch && !write_batch
+#ifdef SUPPORT_HARD_LINKS
+	 && !(preserve_hard_links && F_IS_HLINKED(file))
+#endif
+	 && try_session_copy(file, fname, ndx, fnamecmpbuf, &sx, itemizing)) {
+		if (remove_source_files == 1)
+			goto return_with_success;
+		goto cleanup;
+	}
+
 	init_stat_x(&real_sx);
 	real_sx.st = sx.st; /* Don't copy xattr/acl pointers, as they would free wrong. */
 	real_ret = statret;
@@ -1799,6 +2222,7 @@ static void recv_generator(char *fname, struct file_struct *file, int ndx,
 			do_unlink(partialptr);
 			handle_partial_dir(partialptr, PDIR_DELETE);
 		}
+		remember_session_file(file, fname);
 		set_file_attrs(fname, file, &sx, NULL, maybe_ATTRS_REPORT | maybe_ATTRS_ACCURATE_TIME);
 		if (itemizing)
 			itemize(fnamecmp, file, ndx, statret, &sx, 0, 0, NULL);
@@ -1833,7 +2257,39 @@ static void recv_generator(char *fname, struct file_struct *file, int ndx,
 	if (!do_xfers)
 		goto notify_others;
 
-	if (read_batch || whole_file) {
+	/* A partial-dir file holds the start of an interrupted transfer, so
+	 * we don't generate any checksums for it and just ask the sender for
+	 * the data that follows it.  With --append-guess, the same goes for a
+	 * destination file that looks like it only grew (e.g. a log file): it
+	 * is shorter and not newer than the sender's file.  The prefix is still
+	 * verified by the whole-file checksum, so a wrong guess just causes a
+	 * redo (we avoid guessing when --partial would keep the failed file in
+	 * its place). */
+	if (item_append_ok && !phase && !append_mode && !write_batch
+	 && !read_batch && !whole_file
+	 && sx.st.st_size > 0 && sx.st.st_size < F_LENGTH(file)) {
+		if (fnamecmp_type == FNAMECMP_PARTIAL_DIR)
+			append_item = 1;
+		else if (append_guess && fnamecmp_type == FNAMECMP_FNAME && !inplace
+		 && !(keep_partial && !partial_dir)
+		 && sx.st.st_size >= MIN_AUTO_APPEND_SIZE
+		 && sx.st.st_mtime <= file->modtime)
+			append_item = 1;
+	}
+
+	if (delta_hist_tbl && !read_batch && !whole_file && !append_item && !phase
+	 && F_LENGTH(file) >= MIN_DELTA_HISTORY_SIZE && delta_history_says_whole(fname)) {
+		if (DEBUG_GTE(DELTASUM, 1))
+			rprintf(FINFO, "sending %s whole (recent deltas matched little)\n", fname);
+		send_whole = 1;
+	} else if (auto_whole_file && !read_batch && !append_item && sx.st.st_size > 0
+	 && auto_sends_whole()) {
+		if (DEBUG_GTE(DELTASUM, 1))
+			rprintf(FINFO, "sending %s whole (data rate exceeds checksum rate)\n", fname);
+		send_whole = 1;
+	}
+
+	if (read_batch || whole_file || send_whole) {
 		if (inplace && make_backups > 0 && fnamecmp_type == FNAMECMP_FNAME) {
 			if (!(backupptr = get_backup_name(fname)))
 				goto cleanup;
@@ -1923,6 +2379,8 @@ static void recv_generator(char *fname, struct file_struct *file, int ndx,
 			iflags |= ITEM_BASIS_TYPE_FOLLOWS;
 		if (fnamecmp_type >= FNAMECMP_FUZZY)
 			iflags |= ITEM_XNAME_FOLLOWS;
+		if (append_item)
+			iflags |= ITEM_APPEND;
 		itemize(fnamecmp, file, -1, real_ret, &real_sx, iflags, fnamecmp_type,
 			fuzzy_file ? fuzzy_file->basename : NULL);
 		free_stat_x(&real_sx);
@@ -1938,18 +2396,24 @@ static void recv_generator(char *fname, struct file_struct *file, int ndx,
 	if (read_batch)
 		goto cleanup;
 
-	if (statret != 0 || whole_file)
+	if (statret != 0 || whole_file || send_whole)
 		write_sum_head(f_out, NULL);
 	else if (sx.st.st_size <= 0) {
 		write_sum_head(f_out, NULL);
 		close(fd);
 	} else {
-		if (generate_and_send_sums(fd, sx.st.st_size, f_out, f_copy) < 0) {
+		int save_append_mode = append_mode;
+		OFF_T cache_len = 0;
+		char *cache = append_item ? NULL : basis_cache_add(fd, sx.st.st_size, &cache_len);
+		if (append_item)
+			append_mode = 2;
+		if (generate_and_send_sums(fd, sx.st.st_size, f_out, f_copy, cache, cache_len) < 0) {
 			rprintf(FWARNING,
 				"WARNING: file is too large for checksum sending: %s\n",
 				fnamecmp);
 			write_sum_head(f_out, NULL);
 		}
+		append_mode = save_append_mode;
 		close(fd);
 	}
 
@@ -2120,6 +2584,194 @@ static void touch_up_dirs(struct file_list *flist, int ndx)
 	}
 }
 
+/* The --checkpoint journal holds one line per finished directory: the hex
+ * start of a digest of that directory's file-list entries plus its name.
+ * A restarted run skips the non-dir entries of any list whose digest it
+ * finds, so the list must still match what the sender has (no drift).  The
+ * first line names the destination dir and holds a digest of the options
+ * that affect what we write; a journal whose first line doesn't match
+ * that of this run is ignored (and started afresh). */
+#define CHECKPOINT_DIGEST_LEN 8
+#define CHECKPOINT_MAGIC "#rsync-checkpoint 1 "
+
+static struct hashtable *checkpoint_tbl;
+static FILE *checkpoint_fp;
+int checkpoint_failed = 0;
+
+static void checkpoint_digest(struct file_list *flist, uchar *digest)
+{
+	uchar sum[MD5_DIGEST_LEN];
+	char buf[32], fbuf[MAXPATHLEN];
+	MD5_CTX m5;
+	int i;
+
+	MD5_Init(&m5);
+	for (i = flist->low; i <= flist->high; i++) {
+		struct file_struct *file = flist->sorted[i];
+		if (!F_IS_ACTIVE(file))
+			continue;
+		f_name(file, fbuf);
+		MD5_Update(&m5, (uchar *)fbuf, strlen(fbuf) + 1);
+		SIVAL64(buf, 0, (int64)file->mode);
+		SIVAL64(buf, 8, F_LENGTH(file));
+		SIVAL64(buf, 16, (int64)file->modtime);
+		SIVAL(buf, 24, uid_ndx ? F_OWNER(file) : 0);
+		SIVAL(buf, 28, gid_ndx ? F_GROUP(file) : 0);
+		MD5_Update(&m5, (uchar *)buf, sizeof buf);
+		if (always_checksum > 0 && S_ISREG(file->mode))
+			MD5_Update(&m5, (uchar *)F_SUM(file), flist_csum_len);
+	}
+	MD5_Final(sum, &m5);
+
+	memcpy(digest, sum, CHECKPOINT_DIGEST_LEN);
+}
+
+static int64 checkpoint_key(const uchar *digest)
+{
+	int64 key = 0;
+
+	memcpy(&key, digest, CHECKPOINT_DIGEST_LEN);
+
+	return key ? key : 1; /* hashtable_find() doesn't like a 0 key. */
+}
+
+/* Sets HDR to the journal's first line for this run: a digest of the
+ * options that change what the receiving side writes (or which files it
+ * leaves alone), and the destination dir. */
+static void checkpoint_header(char *hdr, int hdr_size)
+{
+	int opts[] = {
+		preserve_perms, preserve_executability, preserve_uid, preserve_gid,
+		numeric_ids, am_root, preserve_times, preserve_atimes, preserve_crtimes,
+		preserve_acls, preserve_xattrs, preserve_links, copy_links,
+		copy_unsafe_links, safe_symlinks, munge_symlinks, keep_dirlinks,
+		preserve_devices, preserve_specials, write_devices, device_image,
+		preserve_hard_links, always_checksum, ignore_times, size_only,
+		modify_window, update_only, ignore_existing, ignore_non_existing,
+		inplace, append_mode, sparse_files, make_backups, delete_mode,
+		alt_dest_type,
+	};
+	const char *strs[4 + MAX_BASIS_DIRS];
+	uchar sum[MD5_DIGEST_LEN];
+	char buf[16];
+	MD5_CTX m5;
+	int i, j, len;
+
+	MD5_Init(&m5);
+	for (i = 0; i < (int)(sizeof opts / sizeof opts[0]); i++) {
+		SIVAL(buf, 0, opts[i]);
+		MD5_Update(&m5, (uchar *)buf, 4);
+	}
+	SIVAL64(buf, 0, min_size);
+	SIVAL64(buf, 8, max_size);
+	MD5_Update(&m5, (uchar *)buf, 16);
+	strs[0] = make_backups ? backup_dir : NULL;
+	strs[1] = make_backups ? backup_suffix : NULL;
+	strs[2] = usermap;
+	strs[3] = groupmap;
+	for (j = 0; j < MAX_BASIS_DIRS; j++)
+		strs[4 + j] = basis_dir[j];
+	for (i = 0; i < (int)(sizeof strs / sizeof strs[0]); i++) {
+		const char *s = strs[i] ? strs[i] : "";
+		MD5_Update(&m5, (uchar *)s, strlen(s) + 1);
+	}
+	MD5_Final(sum, &m5);
+
+	len = strlcpy(hdr, CHECKPOINT_MAGIC, hdr_size);
+	for (i = 0; i < CHECKPOINT_DIGEST_LEN && len + 2 < hdr_size; i++, len += 2)
+		snprintf(hdr + len, hdr_size - len, "%02x", sum[i]);
+	snprintf(hdr + len, hdr_size - len, " %s\n", curr_dir);
+}
+
+static void checkpoint_load(void)
+{
+	char line[MAXPATHLEN + 64], hdr[MAXPATHLEN + 64];
+	uchar digest[CHECKPOINT_DIGEST_LEN];
+	int i, cnt = 0, same_run = 1;
+	FILE *fp;
+
+	checkpoint_tbl = hashtable_create(1024, HT_KEY64);
+	checkpoint_header(hdr, sizeof hdr);
+
+	if ((fp = fopen(checkpoint_path, "r")) != NULL) {
+		if (!fgets(line, sizeof line, fp))
+			same_run = 0;
+		else if (strcmp(line, hdr) != 0) {
+			rprintf(FWARNING,
+				"checkpoint file %s is for another destination or other options -- starting it afresh\n",
+				checkpoint_path);
+			same_run = 0;
+		}
+		while (same_run && fgets(line, sizeof line, fp)) {
+			for (i = 0; i < CHECKPOINT_DIGEST_LEN * 2; i++) {
+				int val;
+				if (!isHexDigit(line + i))
+					break;
+				val = isDigit(line + i) ? line[i] - '0' : (line[i] | 0x20) - 'a' + 10;
+				if (i & 1)
+					digest[i/2] |= val;
+				else
+					digest[i/2] = val << 4;
+			}
+			if (i < CHECKPOINT_DIGEST_LEN * 2 || line[i] != ' ')
+				continue; /* Ignore a torn or foreign line. */
+			hashtable_find(checkpoint_tbl, checkpoint_key(digest), "");
+			cnt++;
+		}
+		fclose(fp);
+	} else
+		same_run = 0;
+
+	if (!(checkpoint_fp = fopen(checkpoint_path, same_run ? "a" : "w"))) {
+		rsyserr(FERROR, errno, "failed to open checkpoint file %s",
+			checkpoint_path);
+		exit_cleanup(RERR_FILEIO);
+	}
+	if (!same_run) {
+		fputs(hdr, checkpoint_fp);
+		fflush(checkpoint_fp);
+	}
+
+	if (DEBUG_GTE(GENR, 1))
+		rprintf(FINFO, "loaded %d checkpointed dirs from %s\n", cnt, checkpoint_path);
+}
+
+/* Returns 1 if an earlier run recorded this file list as finished. */
+static int checkpoint_done(struct file_list *flist)
+{
+	uchar digest[CHECKPOINT_DIGEST_LEN];
+
+	checkpoint_digest(flist, digest);
+
+	return hashtable_find(checkpoint_tbl, checkpoint_key(digest), NULL) != NULL;
+}
+
+static void checkpoint_flist(struct file_list *flist)
+{
+	uchar digest[CHECKPOINT_DIGEST_LEN];
+	struct ht_int64_node *node;
+	int i;
+
+	/* Once anything has failed we stop recording, since we can't
+	 * always tell which directory the failure belonged to. */
+	if (checkpoint_failed || got_xfer_error || io_error)
+		return;
+
+	checkpoint_digest(flist, digest);
+	node = hashtable_find(checkpoint_tbl, checkpoint_key(digest), (void*)-1L);
+	if (node->data != (void*)-1L)
+		return; /* Already recorded. */
+	node->data = "";
+
+	for (i = 0; i < CHECKPOINT_DIGEST_LEN; i++)
+		fprintf(checkpoint_fp, "%02x", digest[i]);
+	if (flist->parent_ndx >= 0)
+		fprintf(checkpoint_fp, " %s\n", f_name(dir_flist->files[flist->parent_ndx], NULL));
+	else
+		fputs(" .\n", checkpoint_fp);
+	fflush(checkpoint_fp);
+}
+
 void check_for_finished_files(int itemizing, enum logcode code, int check_redo)
 {
 	struct file_struct *file;
@@ -2202,6 +2854,9 @@ void check_for_finished_files(int itemizing, enum logcode code, int check_redo)
 			maybe_flush_socket(!flist_eof && file_total - old_total < MIN_FILECNT_LOOKAHEAD/2);
 		}
 
+		if (checkpoint_tbl)
+			checkpoint_flist(first_flist);
+
 		if (delete_during == 2 || !dir_tweaking) {
 			/* Skip directory touch-up. */
 		} else if (first_flist->parent_ndx >= 0)
@@ -2211,6 +2866,79 @@ void check_for_finished_files(int itemizing, enum logcode code, int check_redo)
 	}
 }
 
+/* With --interleave=SIZE, a file of at least SIZE bytes that would follow
+ * another such file with less than SIZE bytes of smaller files between them
+ * is held back so that the smaller files get interleaved with the big ones
+ * instead of queuing up behind a run of them.  We hold back at most
+ * INTERLEAVE_WINDOW files, and never past a dir entry or the end of their
+ * directory (or of the current file list), so the per-dir handling that
+ * depends on the sorted order is unaffected. */
+#define INTERLEAVE_WINDOW 32
+
+static struct {
+	struct file_struct *file;
+	int ndx;
+} interleave_q[INTERLEAVE_WINDOW];
+static int interleave_head, interleave_cnt, interleave_deferred;
+static OFF_T interleave_gap = -1; /* bytes since the last big file (-1 = none) */
+
+static int is_interleave_big(struct file_struct *file)
+{
+	if (!S_ISREG(file->mode) || F_LENGTH(file) < interleave_size)
+		return 0;
+#ifdef SUPPORT_HARD_LINKS
+	if (preserve_hard_links && F_IS_HLINKED(file))
+		return 0;
+#endif
+	return 1;
+}
+
+static void release_interleaved(int itemizing, enum logcode code, int f_out)
+{
+	char fbuf[MAXPATHLEN];
+	struct file_struct *file = interleave_q[interleave_head].file;
+	int ndx = interleave_q[interleave_head].ndx;
+
+	interleave_head = (interleave_head + 1) % INTERLEAVE_WINDOW;
+	interleave_cnt--;
+	interleave_gap = 0;
+
+	recv_generator(f_name(file, fbuf), file, ndx, itemizing, code, f_out);
+	check_for_finished_files(itemizing, code, 0);
+}
+
+/* Returns 1 if the file was queued instead of being handled now. */
+static int interleave_file(struct file_struct *file, int ndx, int itemizing, enum logcode code, int f_out)
+{
+	int big = is_interleave_big(file);
+
+	if (interleave_cnt && (S_ISDIR(file->mode)
+	 || interleave_q[(interleave_head + interleave_cnt - 1) % INTERLEAVE_WINDOW].file->dirname != file->dirname)) {
+		while (interleave_cnt)
+			release_interleaved(itemizing, code, f_out);
+	}
+
+	if (!big) {
+		if (interleave_gap >= 0 && S_ISREG(file->mode))
+			interleave_gap += F_LENGTH(file);
+		return 0;
+	}
+
+	if (interleave_gap < 0 || (!interleave_cnt && interleave_gap >= interleave_size)) {
+		interleave_gap = 0;
+		return 0;
+	}
+
+	if (interleave_cnt == INTERLEAVE_WINDOW)
+		release_interleaved(itemizing, code, f_out);
+	interleave_q[(interleave_head + interleave_cnt) % INTERLEAVE_WINDOW].file = file;
+	interleave_q[(interleave_head + interleave_cnt) % INTERLEAVE_WINDOW].ndx = ndx;
+	interleave_cnt++;
+	interleave_deferred++;
+
+	return 1;
+}
+
 void generate_files(int f_out, const char *local_name)
 {
 	int i, ndx, next_loopchk = 0;
@@ -2256,18 +2984,27 @@ void generate_files(int f_out, const char *local_name)
 	}
 	info_levels[INFO_FLIST] = info_levels[INFO_PROGRESS] = 0;
 
+	if (whole_file < 0 && append_mode <= 0 && !read_batch)
+		auto_whole_file = 1;
 	if (append_mode > 0 || whole_file < 0)
 		whole_file = 0;
 	if (DEBUG_GTE(FLIST, 1)) {
 		rprintf(FINFO, "delta-transmission %s\n",
 			whole_file
 			? "disabled for local transfer or --whole-file"
-			: "enabled");
+			: auto_whole_file ? "enabled (chosen per file)" : "enabled");
 	}
 
 	dflt_perms = (ACCESSPERMS & ~orig_umask);
 
+	if (checkpoint_path && inc_recurse && !dry_run && !read_batch && !write_batch)
+		checkpoint_load();
+	if (delta_history_path && !dry_run && !read_batch)
+		load_delta_history();
+
 	do {
+		int checkpointed;
+
 #ifdef SUPPORT_HARD_LINKS
 		if (preserve_hard_links && inc_recurse) {
 			while (!flist_eof && file_total < MIN_FILECNT_LOOKAHEAD/2)
@@ -2297,17 +3034,35 @@ void generate_files(int f_out, const char *local_name)
 					change_local_filter_dir(fbuf, strlen(fbuf), F_DEPTH(fp));
 			}
 		}
+		checkpointed = checkpoint_tbl && checkpoint_done(cur_flist);
+		if (checkpointed && DEBUG_GTE(GENR, 1)) {
+			rprintf(FINFO, "skipping checkpointed dir %s\n", cur_flist->parent_ndx < 0 ? "."
+				: f_name(dir_flist->files[cur_flist->parent_ndx], NULL));
+		}
 		for (i = cur_flist->low; i <= cur_flist->high; i++) {
 			struct file_struct *file = cur_flist->sorted[i];
 
 			if (!F_IS_ACTIVE(file))
 				continue;
 
+			/* Dirs still get handled so that their attributes and
+			 * any deletions come out the same as without a journal. */
+			if (checkpointed && !S_ISDIR(file->mode)
+#ifdef SUPPORT_HARD_LINKS
+			 && !(preserve_hard_links && F_IS_HLINKED(file))
+#endif
+			    )
+				continue;
+
 			if (unsort_ndx)
 				ndx = F_NDX(file);
 			else
 				ndx = i + cur_flist->ndx_start;
 
+			if (interleave_size > 0 && !solo_file
+			 && interleave_file(file, ndx, itemizing, code, f_out))
+				continue;
+
 			if (solo_file)
 				strlcpy(fbuf, solo_file, sizeof fbuf);
 			else
@@ -2316,6 +3071,9 @@ void generate_files(int f_out, const char *local_name)
 
 			check_for_finished_files(itemizing, code, 0);
 
+			if (interleave_cnt && interleave_gap >= interleave_size)
+				release_interleaved(itemizing, code, f_out);
+
 			if (i + cur_flist->ndx_start >= next_loopchk) {
 				if (allowed_lull)
 					maybe_send_keepalive(time(NULL), MSK_ALLOW_FLUSH);
@@ -2325,6 +3083,9 @@ void generate_files(int f_out, const char *local_name)
 			}
 		}
 
+		while (interleave_cnt)
+			release_interleaved(itemizing, code, f_out);
+
 		if (!inc_recurse) {
 			write_ndx(f_out, NDX_DONE);
 			break;
@@ -2340,6 +3101,12 @@ void generate_files(int f_out, const char *local_name)
 
 	if (delete_during)
 		delete_in_dir(NULL, NULL, &dev_zero);
+	if (INFO_GTE(STATS, 2) && (auto_delta_files || auto_whole_files))
+		output_auto_whole_stats();
+	if (INFO_GTE(STATS, 2) && interleave_deferred) {
+		rprintf(FINFO, "Number of big files held back for interleaving: %s\n",
+			comma_num(interleave_deferred));
+	}
 	phase++;
 	if (DEBUG_GTE(GENR, 1))
 		rprintf(FINFO, "generate_files phase=%d\n", phase);
@@ -2421,6 +3188,9 @@ void generate_files(int f_out, const char *local_name)
 	 && dir_tweaking && (!inc_recurse || delete_during == 2))
 		touch_up_dirs(dir_flist, -1);
 
+	if (delta_hist_tbl)
+		save_delta_history();
+
 	if (DEBUG_GTE(GENR, 1))
 		rprintf(FINFO, "generate_files finished\n");
 }
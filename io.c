@@ -49,6 +49,9 @@ extern int eol_nulls;
 extern int flist_eof;
 extern int file_total;
 extern int file_old_total;
+extern int flist_cache_monitor_in;
+extern int flist_cache_monitor_out;
+extern int compress_cache_monitor_out;
 extern int list_only;
 extern int read_batch;
 extern int compat_flags;
@@ -58,6 +61,7 @@ extern int daemon_connection;
 extern int protocol_version;
 extern int remove_source_files;
 extern int preserve_hard_links;
+extern int checkpoint_failed;
 extern BOOL extra_flist_sending_enabled;
 extern BOOL flush_ok_after_signal;
 extern struct stats stats;
@@ -84,6 +88,8 @@ int sock_f_out = -1;
 int64 total_data_read = 0;
 int64 total_data_written = 0;
 
+size_t bwshare_writemax = 0;
+
 static struct {
 	xbuf in, out, msg;
 	int in_fd;
@@ -156,6 +162,7 @@ static flist_ndx_list redo_list, hlink_list;
 static void read_a_msg(void);
 static void drain_multiplex_messages(void);
 static void sleep_for_bwlimit(int bytes_written);
+static void bwshare_pace(int bytes_written);
 
 static void check_timeout(BOOL allow_keepalive, int keepalive_flags)
 {
@@ -807,6 +814,8 @@ static char *perform_io(size_t needed, int flags)
 
 			if (bwlimit_writemax && len > bwlimit_writemax)
 				len = bwlimit_writemax;
+			if (bwshare_writemax && len > bwshare_writemax)
+				len = bwshare_writemax;
 
 			if (out->pos + len > out->size)
 				len = out->size - out->pos;
@@ -834,6 +843,8 @@ static char *perform_io(size_t needed, int flags)
 
 			if (bwlimit_writemax)
 				sleep_for_bwlimit(n);
+			if (bwshare_writemax)
+				bwshare_pace(n);
 
 			if ((out->pos += n) == out->size) {
 				if (iobuf.raw_flushing_ends_before)
@@ -1056,6 +1067,8 @@ static void got_flist_entry_status(enum festatus status, int ndx)
 			send_msg_int(MSG_SUCCESS, ndx);
 		/* FALL THROUGH */
 	case FES_NO_SEND:
+		if (status == FES_NO_SEND)
+			checkpoint_failed = 1;
 #ifdef SUPPORT_HARD_LINKS
 		if (preserve_hard_links) {
 			struct file_struct *file = flist->files[ndx - flist->ndx_start];
@@ -1457,6 +1470,20 @@ static void read_a_msg(void)
 		raw_read_buf((char*)&stats.total_read, sizeof stats.total_read);
 		iobuf.in_multiplexed = 1;
 		break;
+	case MSG_XFER_RATE:
+		if (msg_bytes != 16 || !am_generator)
+			goto invalid_msg;
+		raw_read_buf(data, 16);
+		iobuf.in_multiplexed = 1;
+		note_xfer_rate(IVAL64(data, 0), IVAL64(data, 8));
+		break;
+	case MSG_DELTA_RESULT:
+		if (msg_bytes != 20 || !am_generator)
+			goto invalid_msg;
+		raw_read_buf(data, 20);
+		iobuf.in_multiplexed = 1;
+		note_delta_result(IVAL(data, 0), IVAL64(data, 4), IVAL64(data, 12));
+		break;
 	case MSG_REDO:
 		if (msg_bytes != 4 || !am_generator)
 			goto invalid_msg;
@@ -1823,6 +1850,12 @@ int64 read_longint(int f)
 void read_buf(int f, char *buf, size_t len)
 {
 	if (f != iobuf.in_fd) {
+#ifdef SUPPORT_FLIST_CACHE
+		if (f == flist_cache_monitor_in) {
+			read_flist_cache(buf, len);
+			return;
+		}
+#endif
 		if (safe_read(f, buf, len) != len)
 			whine_about_eof(False); /* Doesn't return. */
 		goto batch_copy;
@@ -1993,6 +2026,192 @@ static void sleep_for_bwlimit(int bytes_written)
 	total_written = (sleep_usec - elapsed_usec) * bwlimit / (ONE_SEC/1024);
 }
 
+/* A listening daemon shares a table of rate buckets with its connection
+ * processes so that "module bwlimit" and "user bwlimit" can cap the total
+ * output of all of a module's connections (or of one user's connections).
+ * A bucket holds the time at which its next byte may go out.  After each
+ * write, a connection reserves the written bytes by advancing that time and
+ * sleeps until its reservation ends, so the connections that share a bucket
+ * take turns, and the size of a connection's writes (which "bwlimit weight"
+ * scales) sets its share of the bucket's rate.
+ *
+ * A bucket whose next time is well in the past holds nothing that limits
+ * anyone, so a connection that doesn't find its key within a few probes
+ * takes over such an idle bucket.  A connection checks its buckets' keys
+ * before each use, and looks its key up again if a bucket was taken. */
+#define BWSHARE_PROBES 32
+#define BWSHARE_IDLE_NSEC (2 * ONE_SEC_NSEC)
+#define BWSHARE_QUANTUM 4096
+#define BWSHARE_MAX_WEIGHT 16
+#define ONE_SEC_NSEC 1000000000L
+
+struct bwshare_bucket {
+	volatile uint32 key;
+	volatile int64 next_nsec;
+};
+
+static struct bwshare_bucket *bwshare_table;
+static int bwshare_count;
+static struct bwshare_bucket *bwshare_buckets[2];
+static uint32 bwshare_keys[2];
+static int64 bwshare_rates[2]; /* bytes per second */
+
+static int64 bwshare_now(void);
+
+/* Called by the listening daemon after it (re)loads its config file.  A
+ * new "bwlimit buckets" count starts an empty table (running connections
+ * keep theirs), otherwise the buckets are kept across a reload. */
+void bwshare_init(void)
+{
+#ifdef SUPPORT_SHARED_TABLES
+	int count = MAX(lp_bwlimit_buckets(), 1);
+	void *map;
+
+	if (bwshare_table) {
+		if (count == bwshare_count)
+			return;
+		munmap((void *)bwshare_table, bwshare_count * sizeof (struct bwshare_bucket));
+		bwshare_table = NULL;
+	}
+
+	map = mmap(NULL, count * sizeof (struct bwshare_bucket),
+		   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		rsyserr(FLOG, errno, "unable to map the bwlimit buckets");
+		return;
+	}
+	bwshare_table = map;
+	bwshare_count = count;
+#endif
+}
+
+static uint32 bwshare_key(const char *name)
+{
+	uint32 key = hashlittle(name, strlen(name));
+
+	return key ? key : 1;
+}
+
+/* Returns the bucket of the key, claiming an empty or idle one if the key
+ * has none, or NULL if all the buckets that the key may use are busy. */
+static struct bwshare_bucket *bwshare_find(uint32 key)
+{
+	int probes = MIN(bwshare_count, BWSHARE_PROBES);
+	int tries, j, b;
+
+	for (tries = 0; tries < 3; tries++) {
+		int64 idle_nsec = bwshare_now() - BWSHARE_IDLE_NSEC;
+		struct bwshare_bucket *idle = NULL;
+		uint32 old, idle_key = 0;
+
+		for (j = 0, b = key % bwshare_count; j < probes; j++, b = (b + 1) % bwshare_count) {
+			struct bwshare_bucket *bucket = &bwshare_table[b];
+			if ((old = bucket->key) == 0)
+				old = atomic_cas_val(&bucket->key, 0, key);
+			if (old == 0 || old == key)
+				return bucket;
+			if (!idle && bucket->next_nsec < idle_nsec) {
+				idle = bucket;
+				idle_key = old;
+			}
+		}
+
+		if (!idle)
+			return NULL;
+		if (atomic_cas(&idle->key, idle_key, key)) {
+			/* If another connection took an earlier bucket for
+			 * the key at the same time, both use the first one. */
+			for (j = 0, b = key % bwshare_count; j < probes; j++, b = (b + 1) % bwshare_count) {
+				if (bwshare_table[b].key == key)
+					return &bwshare_table[b];
+			}
+			return idle;
+		}
+	}
+
+	return NULL;
+}
+
+/* Called by a daemon connection once it knows its module and user.  The
+ * user is the auth user, or the client's address if the module has none. */
+void bwshare_setup(int i, const char *user)
+{
+	char name[MAXPATHLEN];
+	const char *group = *lp_bwlimit_group(i) ? lp_bwlimit_group(i) : lp_name(i);
+	int weight = lp_bwlimit_weight(i);
+
+	if (!bwshare_table)
+		return;
+
+	if (lp_module_bwlimit(i) > 0) {
+		snprintf(name, sizeof name, "g:%s", group);
+		bwshare_keys[0] = bwshare_key(name);
+		bwshare_rates[0] = (int64)lp_module_bwlimit(i) * 1024;
+		if (!(bwshare_buckets[0] = bwshare_find(bwshare_keys[0])))
+			rprintf(FLOG, "the bwlimit buckets are full -- not limiting %s\n", group);
+	}
+	if (lp_user_bwlimit(i) > 0) {
+		snprintf(name, sizeof name, "u:%s\n%s", group, user);
+		bwshare_keys[1] = bwshare_key(name);
+		bwshare_rates[1] = (int64)lp_user_bwlimit(i) * 1024;
+		if (!(bwshare_buckets[1] = bwshare_find(bwshare_keys[1])))
+			rprintf(FLOG, "the bwlimit buckets are full -- not limiting %s in %s\n", user, group);
+	}
+
+	if (bwshare_buckets[0] || bwshare_buckets[1])
+		bwshare_writemax = BWSHARE_QUANTUM * MAX(1, MIN(weight, BWSHARE_MAX_WEIGHT));
+}
+
+static int64 bwshare_now(void)
+{
+#if defined HAVE_CLOCK_GETTIME && defined CLOCK_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64)ts.tv_sec * ONE_SEC_NSEC + ts.tv_nsec;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (int64)tv.tv_sec * ONE_SEC_NSEC + tv.tv_usec * 1000L;
+#endif
+}
+
+static void bwshare_pace(int bytes_written)
+{
+	int64 now = bwshare_now(), until = now;
+	int j;
+
+	for (j = 0; j < 2; j++) {
+		struct bwshare_bucket *bucket = bwshare_buckets[j];
+		int64 cost, old, start;
+		if (!bucket)
+			continue;
+		if (bucket->key != bwshare_keys[j]) {
+			/* Our idle bucket was taken over. */
+			if (!(bucket = bwshare_buckets[j] = bwshare_find(bwshare_keys[j]))) {
+				rprintf(FLOG, "the bwlimit buckets are full -- no longer limiting\n");
+				continue;
+			}
+		}
+		cost = (int64)bytes_written * ONE_SEC_NSEC / bwshare_rates[j];
+		do {
+			old = bucket->next_nsec;
+			start = MAX(old, now);
+		} while (!atomic_cas(&bucket->next_nsec, old, start + cost));
+		if (start + cost > until)
+			until = start + cost;
+	}
+
+	if (until > now) {
+		struct timeval tv;
+		int64 usec = (until - now) / 1000;
+		tv.tv_sec  = usec / ONE_SEC;
+		tv.tv_usec = usec % ONE_SEC;
+		select(0, NULL, NULL, NULL, &tv);
+	}
+}
+
 void io_flush(int flush_type)
 {
 	if (iobuf.out.len > iobuf.out_empty_len) {
@@ -2141,6 +2360,14 @@ void write_buf(int f, const char *buf, size_t len)
   batch_copy:
 	if (f == write_batch_monitor_out)
 		safe_write(batch_fd, buf, len);
+#ifdef SUPPORT_FLIST_CACHE
+	if (f == flist_cache_monitor_out)
+		write_flist_cache(buf, len);
+#endif
+#ifdef SUPPORT_COMPRESS_CACHE
+	if (f == compress_cache_monitor_out)
+		write_compress_cache(buf, len);
+#endif
 }
 
 /* Write a string to the connection */
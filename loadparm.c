@@ -92,6 +92,9 @@ static item_list Vars_stack = EMPTY_ITEM_LIST;
 /* The array of section values that holds all the defined modules. */
 static item_list section_list = EMPTY_ITEM_LIST;
 
+/* Maps a hash of each module name to its section number for lp_number(). */
+static struct hashtable *module_tbl;
+
 static int iSectionIndex = -1;
 static BOOL bInGlobalSection = True;
 
@@ -249,6 +252,11 @@ static char *expand_vars(const char *str)
 
 #include "daemon-parm.h"
 
+/* The unexpanded settings that a connection's process starts with. */
+static all_vars raw_Vars;
+static local_vars *raw_sections;
+static size_t raw_section_cnt;
+
 /* Initialise the Default all_vars structure. */
 void reset_daemon_vars(void)
 {
@@ -532,17 +540,103 @@ static BOOL do_section(char *sectionname)
 	return True;
 }
 
+static int32 module_key(const char *name)
+{
+	int32 key = hashlittle(name, strlen(name));
+	return key ? key : 1; /* hashtable_find() doesn't like a 0 key. */
+}
+
+static void index_modules(void)
+{
+	int i;
+
+	if (module_tbl)
+		hashtable_destroy(module_tbl);
+	module_tbl = hashtable_create(section_list.count + 16, HT_KEY32);
+
+	/* A later module with the same name wins, as in lp_number().  We use
+	 * the raw name so that its %VAR% references remain unexpanded. */
+	for (i = 0; i < (int)section_list.count; i++) {
+		const char *name = iSECTION(i).name ? iSECTION(i).name : "";
+		struct ht_int32_node *node = hashtable_find(module_tbl, module_key(name), "");
+		node->data = (void*)(long)(i + 1);
+	}
+}
+
 /* Load the modules from the config file. Return True on success,
  * False on failure. */
 int lp_load(char *pszFname, int globals_only)
 {
+	int ret;
+
 	bInGlobalSection = True;
 
 	reset_daemon_vars();
 
 	/* We get sections first, so have to start 'behind' to make up. */
 	iSectionIndex = -1;
-	return pm_process(pszFname, globals_only ? NULL : do_section, do_parameter);
+	ret = pm_process(pszFname, globals_only ? NULL : do_section, do_parameter);
+
+	if (ret && !globals_only)
+		index_modules();
+
+	return ret;
+}
+
+/* Re-read the config file of a long-running daemon into fresh settings.
+ * If the file can't be parsed, the current settings are kept and False
+ * is returned. */
+int lp_reload(char *pszFname)
+{
+	item_list save_sections = section_list;
+	struct hashtable *save_tbl = module_tbl;
+	all_vars save_vars;
+
+	memcpy(&save_vars, &Vars, sizeof Vars);
+	memset(&section_list, 0, sizeof section_list);
+	module_tbl = NULL;
+
+	if (lp_load(pszFname, 0)) {
+		if (save_sections.items)
+			free(save_sections.items);
+		if (save_tbl)
+			hashtable_destroy(save_tbl);
+		return True;
+	}
+
+	if (section_list.items)
+		free(section_list.items);
+	if (module_tbl)
+		hashtable_destroy(module_tbl);
+	section_list = save_sections;
+	module_tbl = save_tbl;
+	memcpy(&Vars, &save_vars, sizeof Vars);
+	Vars_stack.count = 0;
+
+	return False;
+}
+
+/* A listening daemon parses its config once, and each connection's process
+ * inherits the result.  Since an accessor replaces a string with its %VAR%
+ * expansion, the daemon calls this right after loading the config, and the
+ * connection's process calls lp_restore_raw() so that it expands the strings
+ * in its own environment instead of getting what the daemon expanded. */
+void lp_save_raw(void)
+{
+	memcpy(&raw_Vars, &Vars, sizeof Vars);
+	if (raw_sections)
+		free(raw_sections);
+	raw_section_cnt = section_list.count;
+	raw_sections = raw_section_cnt ? new_array(local_vars, raw_section_cnt) : NULL;
+	if (raw_section_cnt)
+		memcpy(raw_sections, section_list.items, raw_section_cnt * sizeof (local_vars));
+}
+
+void lp_restore_raw(void)
+{
+	memcpy(&Vars, &raw_Vars, sizeof Vars);
+	if (raw_section_cnt == section_list.count && raw_section_cnt)
+		memcpy(section_list.items, raw_sections, raw_section_cnt * sizeof (local_vars));
 }
 
 BOOL set_dparams(int syntax_check_only)
@@ -583,6 +677,17 @@ int lp_number(char *name)
 {
 	int i;
 
+	if (module_tbl) {
+		struct ht_int32_node *node = hashtable_find(module_tbl, module_key(name), NULL);
+		if (node) {
+			i = (int)(long)node->data - 1;
+			if (strcmp(lp_name(i), name) == 0)
+				return i;
+		}
+		/* A hash collision or a name with a %VAR% reference in the
+		 * config, so do it the slow way. */
+	}
+
 	for (i = section_list.count - 1; i >= 0; i--) {
 		if (strcmp(lp_name(i), name) == 0)
 			break;
@@ -71,6 +71,8 @@ extern int rsync_port;
 extern int whole_file;
 extern int read_batch;
 extern int write_batch;
+extern int append_mode;
+extern int inplace;
 extern int batch_fd;
 extern int sock_f_in;
 extern int sock_f_out;
@@ -80,6 +82,7 @@ extern int send_msgs_to_gen;
 extern dev_t filesystem_dev;
 extern pid_t cleanup_child_pid;
 extern size_t bwlimit_writemax;
+extern size_t bwshare_writemax;
 extern unsigned int module_dirlen;
 extern BOOL flist_receiving_enabled;
 extern BOOL want_progress_now;
@@ -99,6 +102,8 @@ extern char *password_file;
 extern char *backup_dir;
 extern char *copy_as;
 extern char *tmpdir;
+extern char *checkpoint_file;
+extern char *delta_history_file;
 extern char curr_dir[MAXPATHLEN];
 extern char backup_dir_buf[MAXPATHLEN];
 extern char *basis_dir[MAX_BASIS_DIRS+1];
@@ -116,6 +121,8 @@ int batch_gen_fd = -1;
 int sender_keeps_checksum = 0;
 int raw_argc, cooked_argc;
 char **raw_argv, **cooked_argv;
+char *checkpoint_path = NULL; /* --checkpoint file, made absolute */
+char *delta_history_path = NULL; /* --delta-history file, made absolute */
 
 /* There's probably never more than at most 2 outstanding child processes,
  * but set it higher, just in case. */
@@ -956,6 +963,8 @@ static void do_server_sender(int f_in, int f_out, int argc, char *argv[])
 
 	send_files(f_in, f_out);
 	io_flush(FULL_FLUSH);
+	if (am_daemon)
+		log_checksum_cache();
 	handle_stats(f_out);
 	if (protocol_version >= 24)
 		read_final_goodbye(f_in, f_out);
@@ -1024,6 +1033,10 @@ static int do_recv(int f_in, int f_out, char *local_name)
 		}
 	}
 
+	/* The receiver can take the matched data from what the generator read. */
+	if (whole_file <= 0 && !append_mode && !inplace && !read_batch && !dry_run)
+		basis_cache_init();
+
 	io_flush(FULL_FLUSH);
 
 	if ((pid = do_fork()) == -1) {
@@ -1045,6 +1058,7 @@ static int do_recv(int f_in, int f_out, char *local_name)
 		f_out = error_pipe[1];
 
 		bwlimit_writemax = 0; /* receiver doesn't need to do this */
+		bwshare_writemax = 0;
 
 		if (read_batch)
 			io_start_buffering_in(f_in);
@@ -1061,6 +1075,8 @@ static int do_recv(int f_in, int f_out, char *local_name)
 
 		write_int(f_out, NDX_DONE);
 		send_msg(MSG_STATS, (char*)&stats.total_read, sizeof stats.total_read, 0);
+		if (am_daemon > 0)
+			metrics_report(0);
 		io_flush(FULL_FLUSH);
 
 		/* Handle any keep-alive packets from the post-processing work
@@ -1823,6 +1839,17 @@ int main(int argc,char *argv[])
 		exit_cleanup(RERR_SYNTAX);
 	}
 
+	/* The generator runs in the destination dir, so a relative journal
+	 * or history path has to be anchored to the dir we started in. */
+	if (checkpoint_file && !(checkpoint_path = normalize_path(checkpoint_file, True, NULL))) {
+		rprintf(FERROR, "the --checkpoint path is too long: %s\n", checkpoint_file);
+		exit_cleanup(RERR_SYNTAX);
+	}
+	if (delta_history_file && !(delta_history_path = normalize_path(delta_history_file, True, NULL))) {
+		rprintf(FERROR, "the --delta-history path is too long: %s\n", delta_history_file);
+		exit_cleanup(RERR_SYNTAX);
+	}
+
 	if (am_server) {
 		set_nonblocking(STDIN_FILENO);
 		set_nonblocking(STDOUT_FILENO);
@@ -25,6 +25,7 @@
 extern int checksum_seed;
 extern int append_mode;
 extern int xfersum_type;
+extern int device_image;
 
 int updating_basis_file;
 char sender_file_sum[MAX_DIGEST_LEN];
@@ -340,6 +341,46 @@ static void hash_search(int f,struct sum_struct *s,
 }
 
 
+/* With --device-image a block's data only ever changes in place, so we just
+ * compare each block with the generator's block at the same offset instead
+ * of searching for a match at every byte. */
+static void aligned_search(int f, struct sum_struct *s, struct map_struct *buf, OFF_T len)
+{
+	OFF_T offset = 0;
+	char sum2[SUM_LENGTH];
+	int32 i;
+
+	if (DEBUG_GTE(DELTASUM, 2)) {
+		rprintf(FINFO, "aligned search b=%ld len=%s\n",
+			(long)s->blength, big_num(len));
+	}
+
+	for (i = 0; i < s->count && offset + s->sums[i].len <= len; i++) {
+		int32 l = s->sums[i].len;
+		char *map = map_ptr(buf, offset, l);
+
+		if (get_checksum1(map, l) == s->sums[i].sum1) {
+			hash_hits++;
+			get_checksum2(map, l, sum2);
+			if (memcmp(sum2, s->sums[i].sum2, s->s2length) == 0) {
+				matched(f, s, buf, offset, i);
+				offset += l;
+				matches++;
+				continue;
+			}
+			false_alarms++;
+		}
+		offset += l;
+		matched(f, s, buf, offset, -2);
+	}
+
+	/* Any data past the end of the basis file is literal. */
+	for (offset = last_match + CHUNK_SIZE; offset < len; offset += CHUNK_SIZE)
+		matched(f, s, buf, offset, -2);
+	matched(f, s, buf, len, -1);
+}
+
+
 /**
  * Scan through a origin file, looking for sections that match
  * checksums from the generator, and transmit either literal or token
@@ -364,7 +405,7 @@ void match_sums(int f, struct sum_struct *s, struct map_struct *buf, OFF_T len)
 	matches = 0;
 	data_transfer = 0;
 
-	sum_init(xfersum_type, checksum_seed);
+	sum_init_threaded(xfersum_type, checksum_seed, len);
 
 	if (append_mode > 0) {
 		if (append_mode == 2) {
@@ -387,7 +428,9 @@ void match_sums(int f, struct sum_struct *s, struct map_struct *buf, OFF_T len)
 		s->count = 0;
 	}
 
-	if (len > 0 && s->count > 0) {
+	if (len > 0 && s->count > 0 && device_image)
+		aligned_search(f, s, buf, len);
+	else if (len > 0 && s->count > 0) {
 		build_hash_table(s);
 
 		if (DEBUG_GTE(DELTASUM, 2))
@@ -397,12 +440,26 @@ void match_sums(int f, struct sum_struct *s, struct map_struct *buf, OFF_T len)
 
 		if (DEBUG_GTE(DELTASUM, 2))
 			rprintf(FINFO,"done hash search\n");
+	} else if (last_match == 0 && send_compress_cache(f, buf, len)) {
+		OFF_T j;
+		/* The saved token stream was sent, but the file's checksum
+		 * (which uses this transfer's seed) still needs its data. */
+		for (j = 0; j < len; j += CHUNK_SIZE) {
+			int32 n1 = (int32)MIN(CHUNK_SIZE, len - j);
+			sum_update(map_ptr(buf, j, n1), n1);
+		}
+		data_transfer = len;
+		last_match = len;
+		if (INFO_GTE(PROGRESS, 1))
+			show_progress(last_match, buf->file_size);
 	} else {
 		OFF_T j;
 		/* by doing this in pieces we avoid too many seeks */
 		for (j = last_match + CHUNK_SIZE; j < len; j += CHUNK_SIZE)
 			matched(f, s, buf, j, -2);
 		matched(f, s, buf, len, -1);
+		if (buf)
+			end_compress_cache(buf);
 	}
 
 	sum_len = sum_end(sender_file_sum);
@@ -0,0 +1,448 @@
+/*
+ * Live counters for a listening daemon, served by its "metrics socket".
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, visit the http://fsf.org website.
+ */
+
+#include "rsync.h"
+#include "ifuncs.h"
+#include "inums.h"
+#ifdef HAVE_SYS_UN_H
+#include <sys/un.h>
+#endif
+
+extern int am_sender;
+extern int am_receiver;
+extern int am_generator;
+extern struct stats stats;
+
+/* A listening daemon keeps a table of per-module counters that it shares
+ * with its connection processes.  The daemon adds its modules to the table
+ * when it loads its config, each connection adds its numbers when it exits,
+ * and the daemon writes the table in the Prometheus text format to whoever
+ * connects to its "metrics socket".  A module stays in the table (with its
+ * counts) even if a reloaded config no longer has it. */
+#define METRICS_MODULES 256
+#define METRICS_CONNS 4096
+#define METRICS_NAME_LEN 256
+
+enum { HIST_FLIST_BUILD, HIST_FLIST_XFER, HIST_CONNECTION, HIST_CNT };
+
+/* The upper bounds (in milliseconds) of all but the last (+Inf) bucket. */
+static const int64 hist_bounds[] = { 10, 100, 1000, 10000, 60000, 600000, 3600000 };
+#define HIST_BUCKETS (int)(sizeof hist_bounds / sizeof hist_bounds[0] + 1)
+
+struct metrics_hist {
+	volatile int64 counts[HIST_BUCKETS];
+	volatile int64 sum_msec;
+};
+
+struct metrics_module {
+	char name[METRICS_NAME_LEN];
+	volatile int64 connections, auth_failures, errors;
+	volatile int64 bytes_read, bytes_written, literal_bytes, matched_bytes, files;
+	struct metrics_hist hists[HIST_CNT];
+};
+
+struct daemon_metrics {
+	int module_cnt;
+	struct metrics_module mods[METRICS_MODULES];
+	struct {
+		volatile pid_t pid;
+		int mod;
+	} recs[METRICS_CONNS];
+};
+
+static struct daemon_metrics *metrics;
+static struct metrics_module *my_mod;
+static pid_t my_pid;
+static struct timeval my_start_tv;
+
+static char *listen_path;
+static pid_t listen_pid;
+
+static char *out_buf;
+static size_t out_len, out_size;
+
+/* Called by the listening daemon after it (re)loads its config file. */
+void metrics_init(void)
+{
+	int i, m;
+
+	if (!*lp_metrics_socket())
+		return;
+
+	if (!metrics) {
+#ifdef SUPPORT_SHARED_TABLES
+		void *map = mmap(NULL, sizeof (struct daemon_metrics), PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (map == MAP_FAILED) {
+			rsyserr(FLOG, errno, "unable to map the daemon metrics");
+			return;
+		}
+		metrics = map;
+#else
+		return;
+#endif
+	}
+
+	for (i = 0; i < lp_num_modules(); i++) {
+		char *name = lp_name(i);
+		if (strlen(name) >= METRICS_NAME_LEN)
+			continue;
+		for (m = 0; m < metrics->module_cnt; m++) {
+			if (strcmp(metrics->mods[m].name, name) == 0)
+				break;
+		}
+		if (m == metrics->module_cnt && m < METRICS_MODULES) {
+			strlcpy(metrics->mods[m].name, name, METRICS_NAME_LEN);
+			memory_barrier();
+			metrics->module_cnt++;
+		}
+	}
+}
+
+static struct metrics_module *find_module(int i)
+{
+	char *name = lp_name(i);
+	int m;
+
+	if (!metrics)
+		return NULL;
+
+	for (m = 0; m < metrics->module_cnt; m++) {
+		if (strcmp(metrics->mods[m].name, name) == 0)
+			return &metrics->mods[m];
+	}
+
+	return NULL;
+}
+
+void metrics_auth_failure(int i)
+{
+	struct metrics_module *mod = find_module(i);
+
+	if (mod)
+		atomic_add(&mod->auth_failures, 1);
+}
+
+/* Called by a connection once it has been let into module i. */
+void metrics_connection_start(int i)
+{
+	int r;
+
+	if (!(my_mod = find_module(i)))
+		return;
+
+	my_pid = getpid();
+	gettimeofday(&my_start_tv, NULL);
+	atomic_add(&my_mod->connections, 1);
+
+	for (r = 0; r < METRICS_CONNS; r++) {
+		if (atomic_cas(&metrics->recs[r].pid, 0, my_pid)) {
+			metrics->recs[r].mod = my_mod - metrics->mods;
+			break;
+		}
+	}
+}
+
+/* Called by the listening daemon when it reaps one of its children. */
+void metrics_release(pid_t pid)
+{
+	int r;
+
+	if (!metrics)
+		return;
+
+	for (r = 0; r < METRICS_CONNS; r++) {
+		if (metrics->recs[r].pid == pid) {
+			metrics->recs[r].pid = 0;
+			break;
+		}
+	}
+}
+
+static void hist_add(int h, int64 msec)
+{
+	struct metrics_hist *hist = &my_mod->hists[h];
+	int b;
+
+	for (b = 0; b < HIST_BUCKETS - 1 && msec > hist_bounds[b]; b++) {}
+	atomic_add(&hist->counts[b], 1);
+	atomic_add(&hist->sum_msec, msec);
+}
+
+/* Called as the main process of a daemon connection exits, and by the
+ * receiver of an upload when it is done.  An upload's stats are split
+ * between the receiver and the generator (which gets the final read count
+ * from the receiver), so each adds only the numbers that it owns. */
+void metrics_report(int code)
+{
+	static int reported;
+	struct timeval now;
+
+	if (!my_mod || reported || (!am_receiver && getpid() != my_pid))
+		return;
+	reported = 1;
+
+	if (!am_generator) {
+		atomic_add(&my_mod->literal_bytes, stats.literal_data);
+		atomic_add(&my_mod->matched_bytes, stats.matched_data);
+		atomic_add(&my_mod->files, stats.xferred_files);
+	}
+	if (am_receiver)
+		return;
+
+	atomic_add(&my_mod->bytes_read, stats.total_read);
+	atomic_add(&my_mod->bytes_written, stats.total_written);
+	if (code != 0)
+		atomic_add(&my_mod->errors, 1);
+
+	if (am_sender && stats.flist_buildtime) {
+		hist_add(HIST_FLIST_BUILD, stats.flist_buildtime);
+		hist_add(HIST_FLIST_XFER, stats.flist_xfertime);
+	}
+	gettimeofday(&now, NULL);
+	hist_add(HIST_CONNECTION, (int64)(now.tv_sec - my_start_tv.tv_sec) * 1000
+				+ (now.tv_usec - my_start_tv.tv_usec) / 1000);
+}
+
+static void out(const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	while (1) {
+		va_start(ap, fmt);
+		len = vsnprintf(out_buf + out_len, out_size - out_len, fmt, ap);
+		va_end(ap);
+		if (len < 0)
+			return;
+		if (out_len + len < out_size)
+			break;
+		out_size = MAX(out_size * 2, out_len + len + 1024);
+		out_buf = realloc_array(out_buf, char, out_size);
+	}
+
+	out_len += len;
+}
+
+/* Module names can hold any character but a ']', so quote them. */
+static void out_label(const char *name)
+{
+	out("{module=\"");
+	for ( ; *name; name++) {
+		if (*name == '"' || *name == '\\')
+			out("\\%c", *name);
+		else
+			out("%c", *name);
+	}
+	out("\"");
+}
+
+static void out_counter(const char *metric, const char *type, const char *help, size_t offset)
+{
+	int m;
+
+	out("# HELP rsyncd_%s %s\n# TYPE rsyncd_%s %s\n", metric, help, metric, type);
+	for (m = 0; m < metrics->module_cnt; m++) {
+		out("rsyncd_%s", metric);
+		out_label(metrics->mods[m].name);
+		out("} %s\n", big_num(*(volatile int64 *)((char *)&metrics->mods[m] + offset)));
+	}
+}
+
+static void out_hist(const char *metric, const char *help, int h)
+{
+	int m, b;
+
+	out("# HELP rsyncd_%s %s\n# TYPE rsyncd_%s histogram\n", metric, help, metric);
+	for (m = 0; m < metrics->module_cnt; m++) {
+		struct metrics_hist *hist = &metrics->mods[m].hists[h];
+		int64 cnt = 0;
+		for (b = 0; b < HIST_BUCKETS; b++) {
+			cnt += hist->counts[b];
+			out("rsyncd_%s_bucket", metric);
+			out_label(metrics->mods[m].name);
+			if (b < HIST_BUCKETS - 1)
+				out(",le=\"%g\"} %s\n", (double)hist_bounds[b] / 1000, big_num(cnt));
+			else
+				out(",le=\"+Inf\"} %s\n", big_num(cnt));
+		}
+		out("rsyncd_%s_sum", metric);
+		out_label(metrics->mods[m].name);
+		out("} %.3f\n", (double)hist->sum_msec / 1000);
+		out("rsyncd_%s_count", metric);
+		out_label(metrics->mods[m].name);
+		out("} %s\n", big_num(cnt));
+	}
+}
+
+static void format_metrics(void)
+{
+	int active[METRICS_MODULES], slots_used[METRICS_MODULES], mod_num[METRICS_MODULES];
+	int m, r;
+
+	memset(active, 0, sizeof active);
+	for (r = 0; r < METRICS_CONNS; r++) {
+		if (metrics->recs[r].pid)
+			active[metrics->recs[r].mod]++;
+	}
+
+	/* A lock file's name is expanded the way a connection of the module
+	 * would expand it, which needs the unexpanded config for each one. */
+	for (m = 0; m < metrics->module_cnt; m++) {
+		slots_used[m] = -1;
+		if ((mod_num[m] = lp_number(metrics->mods[m].name)) < 0)
+			continue;
+		lp_restore_raw();
+		set_env_str("RSYNC_MODULE_NAME", metrics->mods[m].name);
+		slots_used[m] = connection_slots_used(mod_num[m], lp_lock_file(mod_num[m]), 0);
+	}
+
+	if (!out_buf) {
+		out_size = 64 * 1024;
+		out_buf = new_array(char, out_size);
+	}
+	out_len = 0;
+	out("# HELP rsyncd_connections_active Connections that are being served.\n"
+	    "# TYPE rsyncd_connections_active gauge\n");
+	for (m = 0; m < metrics->module_cnt; m++) {
+		out("rsyncd_connections_active");
+		out_label(metrics->mods[m].name);
+		out("} %d\n", active[m]);
+	}
+
+	out("# HELP rsyncd_connection_slots_used The module's \"max connections\" slots that are in use.\n"
+	    "# TYPE rsyncd_connection_slots_used gauge\n");
+	for (m = 0; m < metrics->module_cnt; m++) {
+		if (slots_used[m] < 0)
+			continue;
+		out("rsyncd_connection_slots_used");
+		out_label(metrics->mods[m].name);
+		out("} %d\n", slots_used[m]);
+	}
+	out("# HELP rsyncd_connection_slots The module's \"max connections\" setting.\n"
+	    "# TYPE rsyncd_connection_slots gauge\n");
+	for (m = 0; m < metrics->module_cnt; m++) {
+		if (slots_used[m] < 0)
+			continue;
+		out("rsyncd_connection_slots");
+		out_label(metrics->mods[m].name);
+		out("} %d\n", lp_max_connections(mod_num[m]));
+	}
+
+#define COUNTER(field, help) \
+	out_counter(#field "_total", "counter", help, offsetof(struct metrics_module, field))
+	COUNTER(connections, "Connections that were let into the module.");
+	COUNTER(auth_failures, "Connections that failed to authenticate.");
+	COUNTER(errors, "Connections that ended with an error.");
+	COUNTER(bytes_read, "Bytes read from the module's clients.");
+	COUNTER(bytes_written, "Bytes written to the module's clients.");
+	COUNTER(literal_bytes, "File data that was sent as literal data.");
+	COUNTER(matched_bytes, "File data that was matched in the basis files.");
+	COUNTER(files, "Files that were transferred.");
+#undef COUNTER
+
+	out_hist("flist_build_seconds", "Time that downloads spent building the file list.", HIST_FLIST_BUILD);
+	out_hist("flist_transfer_seconds", "Time that downloads spent sending the file list.", HIST_FLIST_XFER);
+	out_hist("connection_seconds", "Time from a connection's start in the module to its exit.", HIST_CONNECTION);
+}
+
+/* Returns the listening fd of the "metrics socket", or -1. */
+int metrics_listen(void)
+{
+#ifdef HAVE_SYS_UN_H
+	char *path = lp_metrics_socket();
+	struct sockaddr_un saddr;
+	unsigned int len;
+	int fd;
+
+	if (!*path || !metrics)
+		return -1;
+
+	if ((len = strlcpy(saddr.sun_path, path, sizeof saddr.sun_path)) >= sizeof saddr.sun_path) {
+		rprintf(FLOG, "metrics socket %s: path is too long\n", path);
+		return -1;
+	}
+#ifdef HAVE_SOCKADDR_UN_LEN
+	saddr.sun_len = len + 1;
+#endif
+	saddr.sun_family = AF_UNIX;
+
+	if ((fd = socket(PF_UNIX, SOCK_STREAM, 0)) < 0
+	 || (unlink(path) < 0 && errno != ENOENT)
+	 || bind(fd, (struct sockaddr *)&saddr, sizeof saddr) < 0
+	 || listen(fd, 5) < 0) {
+		rsyserr(FLOG, errno, "unable to listen on metrics socket %s", path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	set_nonblocking(fd);
+	listen_path = strdup(path);
+	listen_pid = getpid();
+
+	return fd;
+#else
+	if (*lp_metrics_socket())
+		rprintf(FLOG, "metrics socket ignored: not supported on this OS\n");
+	return -1;
+#endif
+}
+
+/* Called in a child of the listening daemon for each client of its metrics
+ * socket.  The reply is an HTTP response so that a client like "curl
+ * --unix-socket" (or a scraper that can use a unix socket) can fetch it. */
+void metrics_serve(int fd)
+{
+	char buf[4096], hdr[128];
+	int len, got = 0;
+
+	set_blocking(fd);
+
+	/* Read the request up to its blank line (but we don't look at it). */
+	while (got < (int)sizeof buf - 1) {
+		struct timeval tv;
+		fd_set fds;
+		FD_ZERO(&fds);
+		FD_SET(fd, &fds);
+		tv.tv_sec = 5;
+		tv.tv_usec = 0;
+		if (select(fd + 1, &fds, NULL, NULL, &tv) < 1
+		 || (len = read(fd, buf + got, sizeof buf - 1 - got)) <= 0)
+			break;
+		got += len;
+		buf[got] = '\0';
+		if (strstr(buf, "\r\n\r\n") || strstr(buf, "\n\n"))
+			break;
+	}
+
+	format_metrics();
+	len = snprintf(hdr, sizeof hdr,
+		       "HTTP/1.0 200 OK\r\n"
+		       "Content-Type: text/plain; version=0.0.4\r\n"
+		       "Content-Length: %ld\r\n\r\n", (long)out_len);
+	if (full_write(fd, hdr, len) == len)
+		full_write(fd, out_buf, out_len);
+
+	close(fd);
+}
+
+/* Removes the metrics socket when the listening daemon exits. */
+void metrics_cleanup(void)
+{
+	if (listen_path && listen_pid == getpid())
+		unlink(listen_path);
+}
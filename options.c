@@ -44,10 +44,12 @@ int make_backups = 0;
 int whole_file = -1;
 
 int append_mode = 0;
+int append_guess = 0;
 int keep_dirlinks = 0;
 int copy_dirlinks = 0;
 int copy_links = 0;
 int write_devices = 0;
+int device_image = 0;
 int preserve_links = 0;
 int preserve_hard_links = 0;
 int preserve_acls = 0;
@@ -79,6 +81,7 @@ int sparse_files = 0;
 int preallocate_files = 0;
 int do_compression = 0;
 int do_compression_level = CLVL_NOT_SPECIFIED;
+int compress_threads = 0;
 int am_root = 0; /* 0 = normal, 1 = root, 2 = --super, -1 = --fake-super */
 int am_server = 0;
 int am_sender = 0;
@@ -120,6 +123,7 @@ int need_messages_from_generator = 0;
 int max_delete = INT_MIN;
 OFF_T max_size = -1;
 OFF_T min_size = -1;
+OFF_T interleave_size = 0;
 int ignore_errors = 0;
 int modify_window = 0;
 int blocking_io = -1;
@@ -167,6 +171,8 @@ char *basis_dir[MAX_BASIS_DIRS+1];
 char *config_file = NULL;
 char *shell_cmd = NULL;
 char *logfile_name = NULL;
+char *checkpoint_file = NULL;
+char *delta_history_file = NULL;
 char *logfile_format = NULL;
 char *stdout_format = NULL;
 char *password_file = NULL;
@@ -318,7 +324,7 @@ static int refused_delete_during;
 static int refused_inplace, refused_no_iconv;
 static BOOL usermap_via_chown, groupmap_via_chown;
 static char *outbuf_mode;
-static char *bwlimit_arg, *max_size_arg, *min_size_arg;
+static char *bwlimit_arg, *max_size_arg, *min_size_arg, *interleave_arg;
 static char tmp_partialdir[] = ".~tmp~";
 
 /** Local address to bind.  As a character string because it's
@@ -575,7 +581,7 @@ enum {OPT_SERVER = 1000, OPT_DAEMON, OPT_SENDER, OPT_EXCLUDE, OPT_EXCLUDE_FROM,
       OPT_NO_D, OPT_APPEND, OPT_NO_ICONV, OPT_INFO, OPT_DEBUG, OPT_BLOCK_SIZE,
       OPT_USERMAP, OPT_GROUPMAP, OPT_CHOWN, OPT_BWLIMIT, OPT_STDERR,
       OPT_OLD_COMPRESS, OPT_NEW_COMPRESS, OPT_NO_COMPRESS,
-      OPT_STOP_AFTER, OPT_STOP_AT,
+      OPT_STOP_AFTER, OPT_STOP_AT, OPT_INTERLEAVE,
       OPT_REFUSED_BASE = 9000};
 
 static struct poptOption long_options[] = {
@@ -654,6 +660,8 @@ static struct poptOption long_options[] = {
   {"no-devices",       0,  POPT_ARG_VAL,    &preserve_devices, 0, 0, 0 },
   {"write-devices",    0,  POPT_ARG_VAL,    &write_devices, 1, 0, 0 },
   {"no-write-devices", 0,  POPT_ARG_VAL,    &write_devices, 0, 0, 0 },
+  {"device-image",     0,  POPT_ARG_VAL,    &device_image, 1, 0, 0 },
+  {"no-device-image",  0,  POPT_ARG_VAL,    &device_image, 0, 0, 0 },
   {"specials",         0,  POPT_ARG_VAL,    &preserve_specials, 1, 0, 0 },
   {"no-specials",      0,  POPT_ARG_VAL,    &preserve_specials, 0, 0, 0 },
   {"links",           'l', POPT_ARG_VAL,    &preserve_links, 1, 0, 0 },
@@ -698,6 +706,8 @@ static struct poptOption long_options[] = {
   {"append",           0,  POPT_ARG_NONE,   0, OPT_APPEND, 0, 0 },
   {"append-verify",    0,  POPT_ARG_VAL,    &append_mode, 2, 0, 0 },
   {"no-append",        0,  POPT_ARG_VAL,    &append_mode, 0, 0, 0 },
+  {"append-guess",     0,  POPT_ARG_VAL,    &append_guess, 1, 0, 0 },
+  {"no-append-guess",  0,  POPT_ARG_VAL,    &append_guess, 0, 0, 0 },
   {"del",              0,  POPT_ARG_NONE,   &delete_during, 0, 0, 0 },
   {"delete",           0,  POPT_ARG_NONE,   &delete_mode, 0, 0, 0 },
   {"delete-before",    0,  POPT_ARG_NONE,   &delete_before, 0, 0, 0 },
@@ -746,12 +756,16 @@ static struct poptOption long_options[] = {
   {"skip-compress",    0,  POPT_ARG_STRING, &skip_compress, 0, 0, 0 },
   {"compress-level",   0,  POPT_ARG_INT,    &do_compression_level, 0, 0, 0 },
   {"zl",               0,  POPT_ARG_INT,    &do_compression_level, 0, 0, 0 },
+  {"compress-threads", 0,  POPT_ARG_INT,    &compress_threads, 0, 0, 0 },
   {0,                 'P', POPT_ARG_NONE,   0, 'P', 0, 0 },
   {"progress",         0,  POPT_ARG_VAL,    &do_progress, 1, 0, 0 },
   {"no-progress",      0,  POPT_ARG_VAL,    &do_progress, 0, 0, 0 },
   {"partial",          0,  POPT_ARG_VAL,    &keep_partial, 1, 0, 0 },
   {"no-partial",       0,  POPT_ARG_VAL,    &keep_partial, 0, 0, 0 },
   {"partial-dir",      0,  POPT_ARG_STRING, &partial_dir, 0, 0, 0 },
+  {"checkpoint",       0,  POPT_ARG_STRING, &checkpoint_file, 0, 0, 0 },
+  {"delta-history",    0,  POPT_ARG_STRING, &delta_history_file, 0, 0, 0 },
+  {"interleave",       0,  POPT_ARG_STRING, &interleave_arg, OPT_INTERLEAVE, 0, 0 },
   {"delay-updates",    0,  POPT_ARG_VAL,    &delay_updates, 1, 0, 0 },
   {"no-delay-updates", 0,  POPT_ARG_VAL,    &delay_updates, 0, 0, 0 },
   {"prune-empty-dirs",'m', POPT_ARG_VAL,    &prune_empty_dirs, 1, 0, 0 },
@@ -978,6 +992,8 @@ static void set_refuse_options(void)
 			parse_one_refuse_match(0, "iconv", list_end);
 #endif
 		parse_one_refuse_match(0, "log-file*", list_end);
+		parse_one_refuse_match(0, "checkpoint", list_end);
+		parse_one_refuse_match(0, "delta-history", list_end);
 	}
 
 #ifndef SUPPORT_ATIMES
@@ -1665,6 +1681,12 @@ int parse_arguments(int *argc_p, const char ***argv_p)
 			min_size_arg = strdup(do_big_num(min_size, 0, NULL));
 			break;
 
+		case OPT_INTERLEAVE:
+			if ((interleave_size = parse_size_arg(interleave_arg, 'b', "interleave", 0, -1, False)) < 0)
+				return 0;
+			interleave_arg = strdup(do_big_num(interleave_size, 0, NULL));
+			break;
+
 		case OPT_BWLIMIT: {
 			ssize_t size = parse_size_arg(bwlimit_arg, 'K', "bwlimit", 512, -1, True);
 			if (size < 0)
@@ -1954,6 +1976,12 @@ int parse_arguments(int *argc_p, const char ***argv_p)
 		}
 	}
 
+	if (compress_threads < 0) {
+		snprintf(err_buf, sizeof err_buf,
+			"--compress-threads=%d is invalid\n", compress_threads);
+		return 0;
+	}
+
 #ifdef HAVE_SETVBUF
 	if (outbuf_mode && !am_server) {
 		int mode = *(uchar *)outbuf_mode;
@@ -2338,7 +2366,7 @@ int parse_arguments(int *argc_p, const char ***argv_p)
 		inplace = 1;
 	}
 
-	if (write_devices) {
+	if (write_devices || device_image) {
 		if (refused_inplace) {
 			create_refuse_error(refused_inplace);
 			return 0;
@@ -2346,6 +2374,20 @@ int parse_arguments(int *argc_p, const char ***argv_p)
 		inplace = 1;
 	}
 
+	if (device_image && whole_file < 0)
+		whole_file = 0;
+
+	if (checkpoint_file && delay_updates) {
+		snprintf(err_buf, sizeof err_buf,
+			 "--checkpoint cannot be used with --delay-updates\n");
+		return 0;
+	}
+
+	/* A batch holds the file data in the order it was requested in, and
+	 * --read-batch expects that to be the file-list order. */
+	if (write_batch || read_batch)
+		interleave_size = 0;
+
 	if (delay_updates && !partial_dir)
 		partial_dir = tmp_partialdir;
 
@@ -2701,6 +2743,10 @@ void server_options(char **args, int *argc_p)
 			args[ac++] = "--max-size";
 			args[ac++] = max_size_arg;
 		}
+		if (interleave_size > 0) {
+			args[ac++] = "--interleave";
+			args[ac++] = interleave_arg;
+		}
 		if (delete_before)
 			args[ac++] = "--delete-before";
 		else if (delete_during == 2)
@@ -2721,14 +2767,29 @@ void server_options(char **args, int *argc_p)
 			args[ac++] = "--super";
 		if (size_only)
 			args[ac++] = "--size-only";
+		if (append_guess)
+			args[ac++] = "--append-guess";
 		if (do_stats)
 			args[ac++] = "--stats";
+		if (checkpoint_file) {
+			args[ac++] = "--checkpoint";
+			args[ac++] = checkpoint_file;
+		}
+		if (delta_history_file) {
+			args[ac++] = "--delta-history";
+			args[ac++] = delta_history_file;
+		}
 	} else {
 		if (skip_compress) {
 			if (asprintf(&arg, "--skip-compress=%s", skip_compress) < 0)
 				goto oom;
 			args[ac++] = arg;
 		}
+		if (do_compression && compress_threads) {
+			if (asprintf(&arg, "--compress-threads=%d", compress_threads) < 0)
+				goto oom;
+			args[ac++] = arg;
+		}
 	}
 
 	if (max_alloc_arg && max_alloc != DEFAULT_MAX_ALLOC) {
@@ -2851,6 +2912,9 @@ void server_options(char **args, int *argc_p)
 	if (write_devices && am_sender)
 		args[ac++] = "--write-devices";
 
+	if (device_image)
+		args[ac++] = "--device-image";
+
 	if (remove_source_files == 1)
 		args[ac++] = "--remove-source-files";
 	else if (remove_source_files)
@@ -2919,6 +2983,7 @@ int maybe_add_e_option(char *buf, int buf_len)
 		buf[x++] = 'I'; /* support inplace_partial behavior */
 		buf[x++] = 'v'; /* use varint for flist & compat flags; negotiate checksum */
 		buf[x++] = 'u'; /* include name of uid 0 & gid 0 in the id map */
+		buf[x++] = 'a'; /* support the per-file ITEM_APPEND transfer flag */
 
 		/* NOTE: Avoid using 'V' -- it was represented with the high bit of a write_byte() that became a write_varint(). */
 	}
@@ -40,6 +40,7 @@ extern int relative_paths;
 extern int preserve_hard_links;
 extern int preserve_perms;
 extern int write_devices;
+extern int device_image;
 extern int preserve_xattrs;
 extern int basis_dir_cnt;
 extern int make_backups;
@@ -61,6 +62,7 @@ extern mode_t orig_umask;
 extern struct stats stats;
 extern char *tmpdir;
 extern char *partial_dir;
+extern char *delta_history_file;
 extern char *basis_dir[MAX_BASIS_DIRS+1];
 extern char sender_file_sum[MAX_DIGEST_LEN];
 extern struct file_list *cur_flist, *first_flist, *dir_flist;
@@ -72,6 +74,10 @@ static int phase = 0, redoing = 0;
 static flist_ndx_list batch_redo_list;
 /* This is non-0 when we are updating the basis file or an identical copy: */
 static int updating_basis_or_equiv;
+/* This is non-0 when the last receive_data() call got block checksums: */
+static int got_delta_sums;
+/* The amount of matched data that came from the generator's basis cache: */
+static int64 basis_cached_data;
 
 #define TMPNAME_SUFFIX ".XXXXXX"
 #define TMPNAME_SUFFIX_LEN ((int)sizeof TMPNAME_SUFFIX - 1)
@@ -246,7 +252,8 @@ static int receive_data(int f_in, char *fname_r, int fd_r, OFF_T size_r,
 	OFF_T offset2;
 	char *data;
 	int32 i;
-	char *map = NULL;
+	char *map = NULL, *cache = NULL;
+	OFF_T cache_len = 0;
 
 #ifdef SUPPORT_PREALLOCATION
 	if (preallocate_files && fd != -1 && total_size > 0 && (!inplace_sizing || total_size > size_r)) {
@@ -268,20 +275,27 @@ static int receive_data(int f_in, char *fname_r, int fd_r, OFF_T size_r,
 		preallocated_len = 0;
 
 	read_sum_head(f_in, &sum);
+	got_delta_sums = sum.count > 0;
 
 	if (fd_r >= 0 && size_r > 0) {
-		int32 read_size = MAX(sum.blength * 2, 16*1024);
+		int32 read_size = MAX(sum.blength * 2, device_image ? IMAGE_IO_SIZE : 16*1024);
 		mapbuf = map_file(fd_r, size_r, read_size, sum.blength);
+		if (sum.count > 0 && append_mode <= 0 && !inplace_sizing)
+			cache = basis_cache_find(fd_r, size_r, &cache_len);
 		if (DEBUG_GTE(DELTASUM, 2)) {
-			rprintf(FINFO, "recv mapped %s of size %s\n",
-				fname_r, big_num(size_r));
+			rprintf(FINFO, "recv mapped %s of size %s%s\n",
+				fname_r, big_num(size_r), cache ? " (cached)" : "");
 		}
 	} else
 		mapbuf = NULL;
 
-	sum_init(xfersum_type, checksum_seed);
+	sum_init_threaded(xfersum_type, checksum_seed, F_LENGTH(file));
 
 	if (append_mode > 0) {
+		/* When we're not updating the basis file in place (which can
+		 * happen for a per-file append), the basis data also needs to
+		 * be copied into the new file. */
+		int copy_basis = append_mode == 2 && mapbuf && !inplace_sizing && fd != -1;
 		OFF_T j;
 		sum.flength = (OFF_T)sum.count * sum.blength;
 		if (sum.remainder)
@@ -290,19 +304,24 @@ static int receive_data(int f_in, char *fname_r, int fd_r, OFF_T size_r,
 			for (j = CHUNK_SIZE; j < sum.flength; j += CHUNK_SIZE) {
 				if (INFO_GTE(PROGRESS, 1))
 					show_progress(offset, total_size);
-				sum_update(map_ptr(mapbuf, offset, CHUNK_SIZE),
-					   CHUNK_SIZE);
+				map = map_ptr(mapbuf, offset, CHUNK_SIZE);
+				sum_update(map, CHUNK_SIZE);
+				if (copy_basis && write_file(fd, 0, offset, map, CHUNK_SIZE) != CHUNK_SIZE)
+					goto report_write_error;
 				offset = j;
 			}
 			if (offset < sum.flength) {
 				int32 len = (int32)(sum.flength - offset);
 				if (INFO_GTE(PROGRESS, 1))
 					show_progress(offset, total_size);
-				sum_update(map_ptr(mapbuf, offset, len), len);
+				map = map_ptr(mapbuf, offset, len);
+				sum_update(map, len);
+				if (copy_basis && write_file(fd, 0, offset, map, len) != len)
+					goto report_write_error;
 			}
 		}
 		offset = sum.flength;
-		if (fd != -1 && (j = do_lseek(fd, offset, SEEK_SET)) != offset) {
+		if (fd != -1 && !copy_basis && (j = do_lseek(fd, offset, SEEK_SET)) != offset) {
 			rsyserr(FERROR_XFER, errno, "lseek of %s returned %s, not %s",
 				full_fname(fname), big_num(j), big_num(offset));
 			exit_cleanup(RERR_FILEIO);
@@ -334,6 +353,11 @@ static int receive_data(int f_in, char *fname_r, int fd_r, OFF_T size_r,
 		}
 
 		i = -(i+1);
+		if (i >= sum.count) {
+			rprintf(FERROR, "Invalid block index %d received for %s [%s]\n",
+				i, f_name(file, NULL), who_am_i());
+			exit_cleanup(RERR_PROTOCOL);
+		}
 		offset2 = i * (OFF_T)sum.blength;
 		len = sum.blength;
 		if (i == (int)sum.count-1 && sum.remainder != 0)
@@ -348,7 +372,13 @@ static int receive_data(int f_in, char *fname_r, int fd_r, OFF_T size_r,
 				updating_basis_or_equiv && offset == offset2 ? " (seek)" : "");
 		}
 
-		if (mapbuf) {
+		if (cache && offset2 + len <= cache_len) {
+			map = cache + offset2;
+			basis_cached_data += len;
+
+			see_token(map, len);
+			sum_update(map, len);
+		} else if (mapbuf) {
 			map = map_ptr(mapbuf,offset2,len);
 
 			see_token(map, len);
@@ -394,6 +424,8 @@ static int receive_data(int f_in, char *fname_r, int fd_r, OFF_T size_r,
 
 	sum_len = sum_end(file_sum1);
 
+	if (cache)
+		basis_cache_done();
 	if (mapbuf)
 		unmap_file(mapbuf);
 
@@ -411,6 +443,40 @@ static void discard_receive_data(int f_in, struct file_struct *file)
 	receive_data(f_in, NULL, -1, 0, NULL, -1, file, 0);
 }
 
+/* Tell the generator how well the delta-transfer algorithm did on a file for
+ * its --delta-history. */
+static void report_delta_result(int ndx, int64 literal, int64 matched)
+{
+	char buf[20];
+
+	SIVAL(buf, 0, ndx);
+	SIVAL64(buf, 4, literal);
+	SIVAL64(buf, 12, matched);
+	send_msg(MSG_DELTA_RESULT, buf, sizeof buf, 0);
+}
+
+/* Tell the generator how fast a mostly-literal file's data arrived so that
+ * it can choose between delta and whole-file transfers. */
+static void report_xfer_rate(struct timeval *start_tv, int64 literal, int64 matched)
+{
+	struct timeval now;
+	char buf[16];
+	int64 usec;
+
+	if (literal < MIN_XFER_RATE_SAMPLE || matched > literal / 8)
+		return;
+
+	gettimeofday(&now, NULL);
+	usec = (int64)(now.tv_sec - start_tv->tv_sec) * 1000000
+	     + (now.tv_usec - start_tv->tv_usec);
+	if (usec <= 0)
+		return;
+
+	SIVAL64(buf, 0, literal);
+	SIVAL64(buf, 8, usec);
+	send_msg(MSG_XFER_RATE, buf, sizeof buf, 0);
+}
+
 static void handle_delayed_updates(char *local_name)
 {
 	char *fname, *partialptr;
@@ -531,7 +597,9 @@ int recv_files(int f_in, int f_out, char *local_name)
 #ifdef SUPPORT_ACLS
 	const char *parent_dirname = "";
 #endif
-	int ndx, recv_ok, one_inplace;
+	int ndx, recv_ok, one_inplace, report_rates = 0;
+	int64 start_literal = 0, start_matched = 0;
+	struct timeval start_tv;
 
 	if (DEBUG_GTE(RECV, 1))
 		rprintf(FINFO, "recv_files(%d) starting\n", cur_flist->used);
@@ -539,8 +607,11 @@ int recv_files(int f_in, int f_out, char *local_name)
 	if (delay_updates)
 		delayed_bits = bitbag_create(cur_flist->used + 1);
 
-	if (whole_file < 0)
+	if (whole_file < 0) {
+		/* The generator is choosing delta vs whole-file per file. */
+		report_rates = append_mode <= 0 && !read_batch;
 		whole_file = 0;
+	}
 
 	progress_init();
 
@@ -857,7 +928,28 @@ int recv_files(int f_in, int f_out, char *local_name)
 			rprintf(FINFO, "%s\n", fname);
 
 		/* recv file data */
-		recv_ok = receive_data(f_in, fnamecmp, fd1, st.st_size, fname, fd2, file, inplace || one_inplace);
+		if (report_rates || delta_history_file) {
+			gettimeofday(&start_tv, NULL);
+			start_literal = stats.literal_data;
+			start_matched = stats.matched_data;
+		}
+		if (iflags & ITEM_APPEND && !append_mode) {
+			/* The sender is only sending what follows the basis
+			 * file's data, just like an --append-verify. */
+			append_mode = 2;
+			recv_ok = receive_data(f_in, fnamecmp, fd1, st.st_size, fname, fd2, file, inplace || one_inplace);
+			append_mode = 0;
+		} else
+			recv_ok = receive_data(f_in, fnamecmp, fd1, st.st_size, fname, fd2, file, inplace || one_inplace);
+		if (report_rates) {
+			report_xfer_rate(&start_tv, stats.literal_data - start_literal,
+					 stats.matched_data - start_matched);
+		}
+		if (delta_history_file && got_delta_sums && !append_mode && !(iflags & ITEM_APPEND)
+		 && !redoing && recv_ok > 0) {
+			report_delta_result(ndx, stats.literal_data - start_literal,
+					    stats.matched_data - start_matched);
+		}
 
 		log_item(log_code, file, iflags, NULL);
 		if (want_progress_now)
@@ -957,6 +1049,12 @@ int recv_files(int f_in, int f_out, char *local_name)
 	if (phase == 2 && delay_updates) /* for protocol_version < 29 */
 		handle_delayed_updates(local_name);
 
+	if (INFO_GTE(STATS, 2) && stats.matched_data) {
+		rprintf(FINFO, "Basis data re-read: %s bytes (%s more from the basis cache)\n",
+			comma_num(stats.matched_data - basis_cached_data),
+			comma_num(basis_cached_data));
+	}
+
 	if (DEBUG_GTE(RECV, 1))
 		rprintf(FINFO,"recv_files finished\n");
 
@@ -156,6 +156,15 @@
 #define WRITE_SIZE (32*1024)
 #define CHUNK_SIZE (32*1024)
 #define MAX_MAP_SIZE (256*1024)
+#define IMAGE_IO_SIZE (4*1024*1024)
+#define MIN_SESSION_COPY_SIZE (64*1024)
+#define MIN_AUTO_APPEND_SIZE (64*1024)
+#define MIN_XFER_RATE_SAMPLE (64*1024)
+#define MIN_AUTO_WHOLE_BYTES (1024*1024)
+#define AUTO_WHOLE_WINDOW (64*1024*1024)
+#define MIN_DELTA_HISTORY_SIZE (64*1024)
+#define BASIS_CACHE_SIZE (32*1024*1024)
+#define MIN_BASIS_CACHE_DATA (256*1024)
 #define IO_BUFFER_SIZE (32*1024)
 #define MAX_BLOCK_SIZE ((int32)1 << 17)
 
@@ -220,6 +229,7 @@
 #define ITEM_REPORT_GROUP (1<<6)
 #define ITEM_REPORT_ACL (1<<7)
 #define ITEM_REPORT_XATTR (1<<8)
+#define ITEM_APPEND (1<<9)          /* basis is a prefix: no sums, send only the rest */
 #define ITEM_REPORT_CRTIME (1<<10)
 #define ITEM_BASIS_TYPE_FOLLOWS (1<<11)
 #define ITEM_XNAME_FOLLOWS (1<<12)
@@ -275,6 +285,8 @@ enum msgcode {
 	MSG_SUCCESS=100,/* successfully updated indicated flist index */
 	MSG_DELETED=101,/* successfully deleted a file on receiving side */
 	MSG_NO_SEND=102,/* sender failed to open a file we wanted */
+	MSG_XFER_RATE=103,/* receiver's file-data rate for the generator (sibling only) */
+	MSG_DELTA_RESULT=104,/* a file's literal & matched counts for the generator (sibling only) */
 };
 
 enum filetype {
@@ -391,6 +403,9 @@ enum delret {
 #endif
 
 #include <signal.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 #ifdef HAVE_SYS_WAIT_H
 #include <sys/wait.h>
 #endif
@@ -1220,6 +1235,41 @@ extern int errno;
 #define SUPPORT_HARD_LINKS 1
 #endif
 
+#if defined HAVE_OPENAT && defined HAVE_RENAMEAT && defined HAVE_UNLINKAT
+#define SUPPORT_FLIST_CACHE 1
+#define SUPPORT_COMPRESS_CACHE 1
+#endif
+
+#if defined HAVE_PTHREAD_H && defined HAVE_PTHREAD_CREATE
+#define SUPPORT_SUM_THREAD 1
+#endif
+
+#if !defined MAP_ANONYMOUS && defined MAP_ANON
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* The tables that a listening daemon shares with its connection processes
+ * (and the basis cache that the generator shares with the receiver) need
+ * shared anonymous memory and atomic operations.  Without them the tables
+ * are never set up, so the plain versions below are never reached. */
+#if defined HAVE_MMAP && defined MAP_SHARED && defined MAP_ANONYMOUS && defined HAVE_SYNC_BUILTINS
+#define SUPPORT_SHARED_TABLES 1
+#endif
+
+#ifdef HAVE_SYNC_BUILTINS
+#define atomic_cas(ptr, old, new) __sync_bool_compare_and_swap(ptr, old, new)
+#define atomic_cas_val(ptr, old, new) __sync_val_compare_and_swap(ptr, old, new)
+#define atomic_add(ptr, val) __sync_fetch_and_add(ptr, val)
+#define atomic_sub(ptr, val) __sync_fetch_and_sub(ptr, val)
+#define memory_barrier() __sync_synchronize()
+#else
+#define atomic_cas(ptr, old, new) (*(ptr) == (old) ? (*(ptr) = (new), 1) : 0)
+#define atomic_cas_val(ptr, old, new) (*(ptr) == (old) ? (*(ptr) = (new), (old)) : *(ptr))
+#define atomic_add(ptr, val) (*(ptr) += (val))
+#define atomic_sub(ptr, val) (*(ptr) -= (val))
+#define memory_barrier()
+#endif
+
 #ifdef HAVE_SIGACTION
 #define SIGACTION(n,h) sigact.sa_handler=(h), sigaction((n),&sigact,NULL)
 #define signal(n,h) we_need_to_call_SIGACTION_not_signal(n,h)
@@ -32,6 +32,7 @@ extern int logfile_format_has_i;
 extern int want_xattr_optim;
 extern int csum_length;
 extern int append_mode;
+extern int device_image;
 extern int copy_links;
 extern int io_error;
 extern int flist_eof;
@@ -184,6 +185,58 @@ static void write_ndx_and_attrs(int f_out, int ndx, int iflags,
 #endif
 }
 
+#if defined HAVE_POSIX_FADVISE && defined POSIX_FADV_WILLNEED
+#define PREFETCH_MAX_FILES 16
+#define PREFETCH_BUDGET (16 * MAX_MAP_SIZE)
+
+/* When the generator is asking for one file after another (e.g. when most
+ * of the files are new), ask the OS to start reading the first window of
+ * the next few files in the list so that the disk doesn't sit idle while
+ * we finish sending the current one.  If the generator skipped a file since
+ * its last request, we assume that it is mostly finding up-to-date files and
+ * we don't read ahead data it probably won't want.  We stop when we reach a
+ * file in a different source dir (we'd have to chdir to open it) or when the
+ * amount of data already requested would exceed our budget. */
+static void prefetch_next_files(struct file_struct *cur_file, int ndx)
+{
+	static int prev_ndx = -1, prefetched_ndx = -1;
+	char fname[MAXPATHLEN];
+	int32 budget = PREFETCH_BUDGET;
+	int i, fd, start = MAX(prev_ndx + 1, cur_flist->ndx_start);
+
+	if (ndx <= prev_ndx || ndx < cur_flist->ndx_start) {
+		prev_ndx = ndx;
+		return;
+	}
+	prev_ndx = ndx;
+
+	for (i = start; i < ndx; i++) {
+		struct file_struct *file = cur_flist->files[i - cur_flist->ndx_start];
+		if (S_ISREG(file->mode) && F_LENGTH(file) != 0)
+			return;
+	}
+
+	for (i = ndx + 1; i < cur_flist->ndx_start + cur_flist->used && i <= ndx + PREFETCH_MAX_FILES; i++) {
+		struct file_struct *file = cur_flist->files[i - cur_flist->ndx_start];
+		int32 len;
+		if (!S_ISREG(file->mode) || F_LENGTH(file) == 0)
+			continue;
+		if (F_PATHNAME(file) != F_PATHNAME(cur_file))
+			break;
+		len = F_LENGTH(file) < MAX_MAP_SIZE ? (int32)F_LENGTH(file) : MAX_MAP_SIZE;
+		if ((budget -= len) < 0)
+			break;
+		if (i <= prefetched_ndx)
+			continue;
+		if ((fd = do_open(f_name(file, fname), O_RDONLY, 0)) < 0)
+			continue;
+		posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+		close(fd);
+		prefetched_ndx = i;
+	}
+}
+#endif
+
 void send_files(int f_in, int f_out)
 {
 	int fd = -1;
@@ -200,7 +253,7 @@ void send_files(int f_in, int f_out)
 	enum logcode log_code = log_before_transfer ? FLOG : FINFO;
 	int f_xfer = write_batch < 0 ? batch_fd : f_out;
 	int save_io_error = io_error;
-	int ndx, j;
+	int ndx, j, append_item = 0;
 
 	if (DEBUG_GTE(SEND, 1))
 		rprintf(FINFO, "send_files starting\n");
@@ -221,6 +274,11 @@ void send_files(int f_in, int f_out)
 					 xname, &xlen);
 		extra_flist_sending_enabled = False;
 
+		if (append_item) {
+			append_mode = 0;
+			append_item = 0;
+		}
+
 		if (ndx == NDX_DONE) {
 			if (!am_server && cur_flist) {
 				set_current_file_index(NULL, 0);
@@ -332,6 +390,13 @@ void send_files(int f_in, int f_out)
 			continue;
 		}
 
+		/* The generator found that its basis file is a prefix of
+		 * this file, so we handle it like an --append-verify. */
+		if (iflags & ITEM_APPEND && !append_mode) {
+			append_mode = 2;
+			append_item = 1;
+		}
+
 		if (!(s = receive_sums(f_in))) {
 			io_error |= IOERR_GENERAL;
 			rprintf(FERROR_XFER, "receive_sums failed\n");
@@ -377,7 +442,7 @@ void send_files(int f_in, int f_out)
 		}
 
 		if (st.st_size) {
-			int32 read_size = MAX(s->blength * 3, MAX_MAP_SIZE);
+			int32 read_size = MAX(s->blength * 3, device_image ? IMAGE_IO_SIZE : MAX_MAP_SIZE);
 			mbuf = map_file(fd, st.st_size, read_size, s->blength);
 		} else
 			mbuf = NULL;
@@ -387,6 +452,10 @@ void send_files(int f_in, int f_out)
 				path,slash,fname, big_num(st.st_size));
 		}
 
+#if defined HAVE_POSIX_FADVISE && defined POSIX_FADV_WILLNEED
+		prefetch_next_files(file, ndx);
+#endif
+
 		write_ndx_and_attrs(f_out, ndx, iflags, fname, file, fnamecmp_type, xname, xlen);
 		write_sum_head(f_xfer, s);
 
@@ -522,7 +522,11 @@ int is_a_socket(int fd)
 static void sigchld_handler(UNUSED(int val))
 {
 #ifdef WNOHANG
-	while (waitpid(-1, NULL, WNOHANG) > 0) {}
+	pid_t pid;
+	while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+		release_connection_slot(pid);
+		metrics_release(pid);
+	}
 #endif
 #ifndef HAVE_SIGACTION
 	signal(SIGCHLD, sigchld_handler);
@@ -530,6 +534,227 @@ static void sigchld_handler(UNUSED(int val))
 }
 
 
+static int metrics_fd = -1;
+
+/* A metrics client gets its own short-lived child so that a slow one can't
+ * stall the daemon. */
+static void fork_metrics_client(void)
+{
+	int fd = accept(metrics_fd, NULL, NULL);
+
+	if (fd < 0)
+		return;
+
+	SIGACTION(SIGCHLD, sigchld_handler);
+
+	if (fork() == 0) {
+		metrics_serve(fd);
+		_exit(0);
+	}
+
+	close(fd);
+}
+
+
+/* With "min spare workers" set, the daemon forks its connection handlers
+ * before the connections arrive: each idle worker waits in accept() on the
+ * listening sockets itself, and tells the parent (via pool_fds) when it got
+ * a connection so that the parent can fork a replacement.  A worker still
+ * handles just one connection, so the per-connection chroot and privilege
+ * changes of start_daemon() are unchanged.  The parent keeps more spares
+ * around (up to "max spare workers") while connections keep coming in, and
+ * when it wants fewer it writes a byte to retire_fds that makes whichever
+ * idle worker reads it exit. */
+static int pool_fds[2], retire_fds[2];
+
+static void pool_report(int msg)
+{
+	while (write(pool_fds[1], &msg, sizeof msg) < 0 && errno == EINTR) {}
+}
+
+static void pool_worker(int *sp, fd_set *deffds, int maxfd, int (*fn)(int, int))
+{
+	int i, fd, ret;
+
+	if (pid_file_fd >= 0)
+		close(pid_file_fd);
+	if (metrics_fd >= 0)
+		close(metrics_fd);
+	close(pool_fds[0]);
+	close(retire_fds[1]);
+
+	if (maxfd < retire_fds[0])
+		maxfd = retire_fds[0];
+
+	while (1) {
+		struct sockaddr_storage addr;
+		socklen_t addrlen = sizeof addr;
+		fd_set fds;
+
+#ifdef FD_COPY
+		FD_COPY(deffds, &fds);
+#else
+		fds = *deffds;
+#endif
+		FD_SET(retire_fds[0], &fds);
+
+		if (select(maxfd + 1, &fds, NULL, NULL, NULL) < 1)
+			continue;
+
+		if (FD_ISSET(retire_fds[0], &fds)) {
+			char ch;
+			switch (read(retire_fds[0], &ch, 1)) {
+			case 0: /* The parent is gone. */
+				_exit(0);
+			case 1:
+				pool_report(-(int)getpid());
+				_exit(0);
+			}
+		}
+
+		/* The other idle workers race us for the connection, which
+		 * is why the listening sockets are non-blocking. */
+		for (i = 0, fd = -1; sp[i] >= 0; i++) {
+			if (FD_ISSET(sp[i], &fds)
+			 && (fd = accept(sp[i], (struct sockaddr *)&addr, &addrlen)) >= 0)
+				break;
+		}
+		if (fd >= 0)
+			break;
+	}
+
+	pool_report((int)getpid());
+	close(pool_fds[1]);
+	close(retire_fds[0]);
+	for (i = 0; sp[i] >= 0; i++)
+		close(sp[i]);
+	set_blocking(fd);
+
+	logfile_reopen();
+	ret = fn(fd, fd);
+	close_all();
+	_exit(ret);
+}
+
+static void drop_idle_worker(pid_t *idle_pids, int *idle_cnt, pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < *idle_cnt; i++) {
+		if (idle_pids[i] == pid) {
+			idle_pids[i] = idle_pids[--*idle_cnt];
+			break;
+		}
+	}
+}
+
+static void run_worker_pool(int *sp, fd_set *deffds, int maxfd, int (*fn)(int, int))
+{
+	int min_spare = lp_min_spare_workers();
+	int max_spare = MAX(lp_max_spare_workers(), min_spare);
+	int idle_cnt = 0, idle_size = 0, retiring = 0, recent = 0, stale = 0, want, i;
+	pid_t *idle_pids = NULL;
+
+	if (fd_pair(pool_fds) < 0 || fd_pair(retire_fds) < 0) {
+		rsyserr(FERROR, errno, "pipe failed in run_worker_pool");
+		exit_cleanup(RERR_IPC);
+	}
+	set_nonblocking(retire_fds[0]);
+	for (i = 0; sp[i] >= 0; i++)
+		set_nonblocking(sp[i]);
+
+	logfile_close();
+	SIGACTION(SIGCHLD, sigchld_handler);
+
+	while (1) {
+		int msgs[64], cnt;
+		struct timeval tv;
+		fd_set fds;
+		pid_t pid;
+
+		/* Forget any idle worker that died without telling us. */
+		for (i = 0; i < idle_cnt; ) {
+			if (kill(idle_pids[i], 0) < 0 && errno == ESRCH)
+				idle_pids[i] = idle_pids[--idle_cnt];
+			else
+				i++;
+		}
+
+		/* The idle workers forked with the old config (or secrets),
+		 * so retire all of them before we fork any new ones. */
+		if (refresh_daemon_config()) {
+			for ( ; retiring < idle_cnt; retiring++) {
+				if (write(retire_fds[1], "", 1) != 1)
+					break;
+			}
+			stale = 1;
+		}
+		if (stale) {
+			char buf[64];
+			if (idle_cnt > 0)
+				goto wait_for_msgs;
+			/* Eat any retire bytes that no worker was left to read. */
+			while (read(retire_fds[0], buf, sizeof buf) > 0) {}
+			retiring = stale = 0;
+		}
+
+		/* "recent" counts the connections taken lately (it halves
+		 * every quiet second). */
+		want = MIN(min_spare + recent, max_spare);
+
+		while (idle_cnt - retiring < want) {
+			if ((pid = fork()) == 0)
+				pool_worker(sp, deffds, maxfd, fn);
+			if (pid < 0) {
+				rsyserr(FERROR, errno, "could not create child server process");
+				sleep(2);
+				break;
+			}
+			if (idle_cnt == idle_size) {
+				idle_size += 16;
+				idle_pids = realloc_array(idle_pids, pid_t, idle_size);
+			}
+			idle_pids[idle_cnt++] = pid;
+		}
+
+		while (idle_cnt - retiring > want) {
+			if (write(retire_fds[1], "", 1) != 1)
+				break;
+			retiring++;
+		}
+
+	  wait_for_msgs:
+		FD_ZERO(&fds);
+		FD_SET(pool_fds[0], &fds);
+		if (metrics_fd >= 0)
+			FD_SET(metrics_fd, &fds);
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		if (select(MAX(pool_fds[0], metrics_fd) + 1, &fds, NULL, NULL, &tv) < 1) {
+			recent /= 2;
+			continue;
+		}
+
+		if (metrics_fd >= 0 && FD_ISSET(metrics_fd, &fds))
+			fork_metrics_client();
+		if (!FD_ISSET(pool_fds[0], &fds))
+			continue;
+
+		if ((cnt = read(pool_fds[0], msgs, sizeof msgs)) <= 0)
+			continue;
+		for (i = 0; i < cnt / (int)sizeof msgs[0]; i++) {
+			if (msgs[i] < 0) {
+				drop_idle_worker(idle_pids, &idle_cnt, -msgs[i]);
+				if (retiring > 0)
+					retiring--;
+			} else {
+				drop_idle_worker(idle_pids, &idle_cnt, msgs[i]);
+				recent++;
+			}
+		}
+	}
+}
+
 void start_accept_loop(int port, int (*fn)(int, int))
 {
 	fd_set deffds;
@@ -561,6 +786,11 @@ void start_accept_loop(int port, int (*fn)(int, int))
 			maxfd = sp[i];
 	}
 
+	metrics_fd = metrics_listen();
+
+	if (lp_min_spare_workers() > 0)
+		run_worker_pool(sp, &deffds, maxfd, fn);
+
 	/* now accept incoming connections - forking a new process
 	 * for each incoming connection */
 	while (1) {
@@ -580,10 +810,15 @@ void start_accept_loop(int port, int (*fn)(int, int))
 #else
 		fds = deffds;
 #endif
+		if (metrics_fd >= 0)
+			FD_SET(metrics_fd, &fds);
 
-		if (select(maxfd + 1, &fds, NULL, NULL, NULL) < 1)
+		if (select(MAX(maxfd, metrics_fd) + 1, &fds, NULL, NULL, NULL) < 1)
 			continue;
 
+		if (metrics_fd >= 0 && FD_ISSET(metrics_fd, &fds))
+			fork_metrics_client();
+
 		for (i = 0, fd = -1; sp[i] >= 0; i++) {
 			if (FD_ISSET(sp[i], &fds)) {
 				fd = accept(sp[i], (struct sockaddr *)&addr, &addrlen);
@@ -594,12 +829,16 @@ void start_accept_loop(int port, int (*fn)(int, int))
 		if (fd < 0)
 			continue;
 
+		refresh_daemon_config();
+
 		SIGACTION(SIGCHLD, sigchld_handler);
 
 		if ((pid = fork()) == 0) {
 			int ret;
 			if (pid_file_fd >= 0)
 				close(pid_file_fd);
+			if (metrics_fd >= 0)
+				close(metrics_fd);
 			for (i = 0; sp[i] >= 0; i++)
 				close(sp[i]);
 			/* Re-open log file in child before possibly giving
@@ -624,7 +863,7 @@ void start_accept_loop(int port, int (*fn)(int, int))
 }
 
 
-enum SOCK_OPT_TYPES {OPT_BOOL,OPT_INT,OPT_ON};
+enum SOCK_OPT_TYPES {OPT_BOOL,OPT_INT,OPT_ON,OPT_STR};
 
 struct
 {
@@ -665,6 +904,9 @@ struct
 #endif
 #ifdef SO_RCVTIMEO
   {"SO_RCVTIMEO",       SOL_SOCKET,    SO_RCVTIMEO,     0,                 OPT_INT},
+#endif
+#ifdef TCP_CONGESTION
+  {"TCP_CONGESTION",    IPPROTO_TCP,   TCP_CONGESTION,  0,                 OPT_STR},
 #endif
   {NULL,0,0,0,0}
 };
@@ -683,12 +925,13 @@ void set_socket_options(int fd, char *options)
 	for (tok = strtok(options, " \t,"); tok; tok = strtok(NULL," \t,")) {
 		int ret=0,i;
 		int value = 1;
-		char *p;
+		char *p, *str = NULL;
 		int got_value = 0;
 
 		if ((p = strchr(tok,'='))) {
 			*p = 0;
-			value = atoi(p+1);
+			str = p+1;
+			value = atoi(str);
 			got_value = 1;
 		}
 
@@ -721,6 +964,18 @@ void set_socket_options(int fd, char *options)
 						 (char *)&on, sizeof (int));
 			}
 			break;
+
+		case OPT_STR:
+			/* e.g. TCP_CONGESTION=bbr picks the congestion-control
+			 * algorithm used for this one connection. */
+			if (!got_value || !*str) {
+				rprintf(FERROR,"syntax error -- %s requires a value\n",tok);
+				continue;
+			}
+			ret = setsockopt(fd,socket_options[i].level,
+					 socket_options[i].option,
+					 str, strlen(str));
+			break;
 		}
 
 		if (ret != 0) {
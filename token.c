@@ -31,8 +31,10 @@
 
 extern int do_compression;
 extern int protocol_version;
+extern int csum_length;
 extern int module_id;
 extern int do_compression_level;
+extern int compress_threads;
 extern char *skip_compress;
 
 #ifndef Z_INSERT_ONLY
@@ -336,6 +338,7 @@ static int32 last_run_end;
 
 /* Deflation state */
 static z_stream tx_strm;
+static int deflate_level = -1; /* The level that tx_strm was started with. */
 
 /* Output buffer */
 static char *obuf;
@@ -367,6 +370,7 @@ send_deflated_token(int f, int32 token, struct map_struct *buf, OFF_T offset, in
 				rprintf(FERROR, "compression init failed\n");
 				exit_cleanup(RERR_PROTOCOL);
 			}
+			deflate_level = compression_level;
 			obuf = new_array(char, OBUF_SIZE);
 			init_done = 1;
 		} else
@@ -687,6 +691,15 @@ static void send_zstd_token(int f, int32 token, struct map_struct *buf, OFF_T of
 		obuf = new_array(char, OBUF_SIZE);
 
 		ZSTD_CCtx_setParameter(zstd_cctx, ZSTD_c_compressionLevel, do_compression_level);
+		/* This is a no-op (returning an error we ignore) if the zstd
+		 * library was built without multi-threading support.  The
+		 * threads only compress: the sender still finds the matches of
+		 * one file at a time, because the receiver expects each file's
+		 * tokens in order on the one stream, so running match_sums() for
+		 * several files at once would need a new token stream format
+		 * (the sender can use threads, as its hashing thread shows). */
+		if (compress_threads)
+			ZSTD_CCtx_setParameter(zstd_cctx, ZSTD_c_nbWorkers, compress_threads);
 		zstd_out_buff.dst = obuf + 2;
 
 		comp_init_done = 1;
@@ -758,9 +771,11 @@ static void send_zstd_token(int f, int32 token, struct map_struct *buf, OFF_T of
 			}
 			/*
 			 * Loop while the input buffer isn't full consumed or the
-			 * internal state isn't fully flushed.
+			 * internal state isn't fully flushed.  We don't wait for
+			 * the internal state to drain when we're not flushing so
+			 * that zstd's worker threads can keep compressing ahead.
 			 */
-		} while (zstd_in_buff.pos < zstd_in_buff.size || r > 0);
+		} while (zstd_in_buff.pos < zstd_in_buff.size || (flush == ZSTD_e_flush && r > 0));
 		flush_pending = token == -2;
 	}
 
@@ -1106,3 +1121,253 @@ void see_token(char *data, int32 toklen)
 		NOISY_DEATH("Unknown do_compression value");
 	}
 }
+
+/* A daemon module with "compress cache dir" set saves the compressed token
+ * stream of each large file that its sender transfers whole, in a file
+ * named after a hash of the file's identity and the compression settings.
+ * A later sender of the same unchanged file (whole, and with the same
+ * settings) copies the saved stream instead of compressing the data again.
+ * Only the compressors that start each file afresh (zlib, zlibx, and lz4)
+ * are handled, since a zstd stream carries its history from file to file.
+ * An entry holds a magic string, the stream's length, the stream, and an
+ * MD5 digest of the stream.  An entry whose digest doesn't match is removed
+ * (before any of it is sent), as is the entry of a file that is being sent
+ * again because its first transfer failed its checksum. */
+
+#define COMPRESS_CACHE_MAGIC "RSZC2\n\n" /* 8 bytes, counting the '\0' */
+#define COMPRESS_CACHE_HDR_LEN (8 + 8)
+#define COMPRESS_CACHE_MIN_SIZE (256*1024)
+#define COMPRESS_CACHE_BUF_SIZE (256*1024)
+
+int compress_cache_monitor_out = -1;
+
+static int compress_cache_dirfd = -1;
+#ifdef SUPPORT_COMPRESS_CACHE
+static int compress_cache_fd = -1;
+static char *compress_cache_buf;
+static size_t compress_cache_len;
+static int64 compress_cache_total;
+static MD5_CTX compress_cache_sum;
+static int compress_cache_failed;
+static char compress_cache_name[MD5_DIGEST_LEN*2 + 1];
+static char compress_cache_tmp[64];
+static STRUCT_STAT compress_cache_st;
+#endif
+
+/* This is called before any chroot, so the dir need not be inside it. */
+void compress_cache_open_dir(const char *dir)
+{
+#ifdef SUPPORT_COMPRESS_CACHE
+	if ((compress_cache_dirfd = open(dir, O_RDONLY)) < 0)
+		rsyserr(FLOG, errno, "unable to open compress cache dir %s", dir);
+#else
+	rprintf(FLOG, "compress cache dir %s ignored: not supported on this OS\n", dir);
+#endif
+}
+
+#ifdef SUPPORT_COMPRESS_CACHE
+static void compress_cache_key(const STRUCT_STAT *st_p, char *name)
+{
+	uchar sum[MD5_DIGEST_LEN];
+	int64 vals[11];
+	MD5_CTX m5;
+	int i;
+
+	vals[0] = st_p->st_dev;
+	vals[1] = st_p->st_ino;
+	vals[2] = st_p->st_size;
+	vals[3] = st_p->st_mtime;
+#ifdef ST_MTIME_NSEC
+	vals[4] = st_p->ST_MTIME_NSEC;
+#else
+	vals[4] = 0;
+#endif
+	vals[5] = st_p->st_ctime;
+	vals[6] = do_compression;
+	/* The deflate level is the one that the stream was started with. */
+	vals[7] = do_compression == CPRES_LZ4 ? 0 : deflate_level >= 0 ? deflate_level : compression_level;
+	vals[8] = protocol_version;
+	vals[9] = CHUNK_SIZE;
+	vals[10] = MAX_DATA_COUNT;
+
+	MD5_Init(&m5);
+	MD5_Update(&m5, (uchar *)vals, sizeof vals);
+	MD5_Final(sum, &m5);
+	for (i = 0; i < MD5_DIGEST_LEN; i++)
+		snprintf(name + i*2, 3, "%02x", sum[i]);
+}
+
+static void flush_compress_cache(void)
+{
+	if (compress_cache_len && !compress_cache_failed
+	 && full_write(compress_cache_fd, compress_cache_buf, compress_cache_len) < 0) {
+		rsyserr(FLOG, errno, "write of compress cache %s failed", compress_cache_tmp);
+		compress_cache_failed = 1;
+	}
+	compress_cache_len = 0;
+}
+
+/* The write_buf() hook that copies a file's token stream into a new entry. */
+void write_compress_cache(const char *buf, size_t len)
+{
+	compress_cache_total += len;
+	MD5_Update(&compress_cache_sum, (const uchar *)buf, len);
+	while (len && !compress_cache_failed) {
+		size_t siz = MIN(len, COMPRESS_CACHE_BUF_SIZE - compress_cache_len);
+		memcpy(compress_cache_buf + compress_cache_len, buf, siz);
+		compress_cache_len += siz;
+		buf += siz;
+		len -= siz;
+		if (compress_cache_len == COMPRESS_CACHE_BUF_SIZE)
+			flush_compress_cache();
+	}
+}
+
+/* Returns 1 if the entry (whose header has been read) has the right size
+ * and the digest of its stream matches. */
+static int check_compress_cache(int fd, int64 data_len)
+{
+	uchar sum[MD5_DIGEST_LEN], saved_sum[MD5_DIGEST_LEN];
+	STRUCT_STAT st;
+	MD5_CTX m5;
+
+	if (do_fstat(fd, &st) < 0 || data_len <= 0
+	 || st.st_size != COMPRESS_CACHE_HDR_LEN + data_len + MD5_DIGEST_LEN)
+		return 0;
+
+	MD5_Init(&m5);
+	while (data_len > 0) {
+		size_t siz = MIN(data_len, COMPRESS_CACHE_BUF_SIZE);
+		if (!full_read(fd, compress_cache_buf, siz))
+			return 0;
+		MD5_Update(&m5, (uchar *)compress_cache_buf, siz);
+		data_len -= siz;
+	}
+	MD5_Final(sum, &m5);
+
+	return full_read(fd, (char *)saved_sum, sizeof saved_sum)
+	    && memcmp(sum, saved_sum, sizeof sum) == 0
+	    && do_lseek(fd, COMPRESS_CACHE_HDR_LEN, SEEK_SET) == COMPRESS_CACHE_HDR_LEN;
+}
+#endif
+
+/* Returns 1 if a saved token stream for the whole file was sent.  Otherwise
+ * a file that is worth saving has its stream copied (as send_token() writes
+ * it) until end_compress_cache() is called. */
+int send_compress_cache(int f, struct map_struct *buf, OFF_T len)
+{
+#ifdef SUPPORT_COMPRESS_CACHE
+	int64 data_len = 0;
+	char magic[8];
+	size_t pos;
+	int fd;
+
+	if (compress_cache_dirfd < 0 || !buf || len < COMPRESS_CACHE_MIN_SIZE
+	 || (do_compression != CPRES_ZLIB && do_compression != CPRES_ZLIBX
+	  && do_compression != CPRES_LZ4)
+	 || do_fstat(buf->fd, &compress_cache_st) < 0)
+		return 0;
+
+	if (!compress_cache_buf)
+		compress_cache_buf = new_array(char, COMPRESS_CACHE_BUF_SIZE);
+
+	compress_cache_key(&compress_cache_st, compress_cache_name);
+
+	if (csum_length == SUM_LENGTH) {
+		/* This is a resend after a failed checksum. */
+		unlinkat(compress_cache_dirfd, compress_cache_name, 0);
+	} else if ((fd = openat(compress_cache_dirfd, compress_cache_name, O_RDONLY)) >= 0) {
+		if (!full_read(fd, magic, sizeof magic)
+		 || memcmp(magic, COMPRESS_CACHE_MAGIC, sizeof magic) != 0
+		 || !full_read(fd, (char *)&data_len, sizeof data_len)
+		 || !check_compress_cache(fd, data_len)) {
+			rprintf(FLOG, "removing invalid compress cache %s\n", compress_cache_name);
+			unlinkat(compress_cache_dirfd, compress_cache_name, 0);
+		} else {
+			while (data_len > 0) {
+				size_t siz = MIN(data_len, COMPRESS_CACHE_BUF_SIZE);
+				if (!full_read(fd, compress_cache_buf, siz)) {
+					rsyserr(FERROR, errno, "read of compress cache %s failed",
+						compress_cache_name);
+					exit_cleanup(RERR_FILEIO);
+				}
+				data_len -= siz;
+				/* The output buffer can't take more than a chunk at once. */
+				for (pos = 0; pos < siz; pos += CHUNK_SIZE)
+					write_buf(f, compress_cache_buf + pos, MIN(siz - pos, CHUNK_SIZE));
+			}
+			close(fd);
+			return 1;
+		}
+		close(fd);
+	}
+
+	snprintf(compress_cache_tmp, sizeof compress_cache_tmp, ".%s.%d",
+		 compress_cache_name, (int)getpid());
+	compress_cache_fd = openat(compress_cache_dirfd, compress_cache_tmp, O_WRONLY|O_CREAT|O_EXCL, 0644);
+	if (compress_cache_fd < 0) {
+		rsyserr(FLOG, errno, "unable to create compress cache %s", compress_cache_tmp);
+		return 0;
+	}
+
+	compress_cache_len = 0;
+	compress_cache_failed = 0;
+	data_len = 0;
+	write_compress_cache(COMPRESS_CACHE_MAGIC, 8);
+	write_compress_cache((char *)&data_len, sizeof data_len); /* Set at the end. */
+	compress_cache_total = 0;
+	MD5_Init(&compress_cache_sum);
+
+	compress_cache_monitor_out = f;
+#else
+	(void)f;
+	(void)buf;
+	(void)len;
+#endif
+
+	return 0;
+}
+
+/* Saves the copied stream unless the file had a read error or changed. */
+void end_compress_cache(struct map_struct *buf)
+{
+#ifdef SUPPORT_COMPRESS_CACHE
+	int64 data_len = compress_cache_total;
+	uchar sum[MD5_DIGEST_LEN];
+	STRUCT_STAT st;
+
+	if (compress_cache_monitor_out < 0)
+		return;
+	compress_cache_monitor_out = -1;
+
+	MD5_Final(sum, &compress_cache_sum);
+	write_compress_cache((char *)sum, sizeof sum);
+	flush_compress_cache();
+
+	if (buf->status != 0 || do_fstat(buf->fd, &st) < 0
+	 || st.st_size != compress_cache_st.st_size
+	 || st.st_mtime != compress_cache_st.st_mtime
+	 || st.st_ctime != compress_cache_st.st_ctime)
+		compress_cache_failed = 1;
+	else if (!compress_cache_failed
+	 && (do_lseek(compress_cache_fd, 8, SEEK_SET) != 8
+	  || full_write(compress_cache_fd, (char *)&data_len, sizeof data_len) < 0)) {
+		rsyserr(FLOG, errno, "write of compress cache %s failed", compress_cache_tmp);
+		compress_cache_failed = 1;
+	}
+	if (close(compress_cache_fd) < 0)
+		compress_cache_failed = 1;
+	compress_cache_fd = -1;
+
+	if (!compress_cache_failed
+	 && renameat(compress_cache_dirfd, compress_cache_tmp,
+		     compress_cache_dirfd, compress_cache_name) < 0) {
+		rsyserr(FLOG, errno, "rename of compress cache %s failed", compress_cache_tmp);
+		compress_cache_failed = 1;
+	}
+	if (compress_cache_failed)
+		unlinkat(compress_cache_dirfd, compress_cache_tmp, 0);
+#else
+	(void)buf;
+#endif
+}
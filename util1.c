@@ -293,6 +293,22 @@ int full_write(int desc, const char *ptr, size_t len)
 	return total_written;
 }
 
+/* Read exactly @p len bytes at @p ptr from descriptor @p desc, retrying if
+ * interrupted.  Returns 1 on success, or 0 on an error or a premature EOF. */
+int full_read(int desc, char *ptr, size_t len)
+{
+	while (len > 0) {
+		int n_chars = read(desc, ptr, len);
+		if (n_chars < 0 && errno == EINTR)
+			continue;
+		if (n_chars <= 0)
+			return 0;
+		ptr += n_chars;
+		len -= n_chars;
+	}
+	return 1;
+}
+
 /**
  * Read @p len bytes at @p ptr from descriptor @p desc, retrying if
  * interrupted.
@@ -1667,3 +1683,25 @@ void force_memzero(void *buf, size_t len)
 	while (len-- > 0)
 		*z++ = '\0';
 }
+
+/* Try to take a slot lock in a table that processes share.  The lock holds
+ * the pid of its owner, so a lock left behind by a process that was killed
+ * while holding it can be taken over.  Returns 1 if we got the lock. */
+int shared_trylock(volatile pid_t *lock)
+{
+	pid_t owner, pid = getpid();
+
+	if (atomic_cas(lock, 0, pid))
+		return 1;
+
+	if ((owner = *lock) != 0 && owner != pid && kill(owner, 0) < 0 && errno == ESRCH)
+		return atomic_cas(lock, owner, pid);
+
+	return 0;
+}
+
+void shared_unlock(volatile pid_t *lock)
+{
+	memory_barrier();
+	*lock = 0;
+}